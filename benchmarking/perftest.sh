@@ -1,19 +1,47 @@
 #!/bin/bash
 
-echo "N method tsimplify time mem" > $(pwd)/benchmarks.txt
+# Every method is timed the same way: wall time and max RSS from
+# /usr/bin/time, and --stats_json for the peak bytes of the edge
+# buffers.  The timed runs do not check anything.  Checking is a
+# separate, untimed pass after them:
+#   * the sweep compares the tables of sort and radix, and of the
+#     three buffered methods, by checksum;
+#   * one --buffer --verify run compares buffering with sorting.
+
+# The peak bytes used by the edge buffers, from a --stats_json file
+peak_buffer_bytes() {
+    grep '"peak_bytes"' $1 | sed 's/.*"edge_buffer": \([0-9]*\).*/\1/'
+}
+
+# The time, max RSS and peak edge buffer bytes of a run
+result() {
+    echo `cat $1.time` `peak_buffer_bytes $1.json`
+}
+
+echo "N rho method tsimplify time mem buffer_bytes" > $(pwd)/benchmarks.txt
 
 for N in 1000 5000 10000 25000
 do
     runtime=`echo "5*$N"|bc -l`
-    for tsimplify in 100 500 1000
+    for rho in 0 1000
     do
-        SEED=$RANDOM
-        /usr/bin/time -f "%e %M" -o classic.time ./wfbuffered --treefile classic.trees --N $N --simplify $tsimplify --seed $SEED --nsteps $runtime
-        /usr/bin/time -f "%e %M" -o buffered.time ./wfbuffered --treefile buffered.trees --N $N --simplify $tsimplify --buffer --seed $SEED --nsteps $runtime
-        python3 ../compare_treefiles.py $(pwd)/classic.trees $(pwd)/buffered.trees
-        c=`cat classic.time`
-        b=`cat buffered.time`
-        echo $N "sort" $tsimplify $c >> benchmarks.txt
-        echo $N "buffer" $tsimplify $b >> benchmarks.txt
+        for tsimplify in 100 500 1000
+        do
+            SEED=$RANDOM
+            /usr/bin/time -f "%e %M" -o classic.time ./wfbuffered --treefile classic.trees --N $N --rho $rho --simplify $tsimplify --seed $SEED --nsteps $runtime --stats_json classic.json
+            /usr/bin/time -f "%e %M" -o radix.time ./wfbuffered --treefile radix.trees --N $N --rho $rho --simplify $tsimplify --sort radix --seed $SEED --nsteps $runtime --stats_json radix.json
+            /usr/bin/time -f "%e %M" -o buffered.time ./wfbuffered --treefile buffered.trees --N $N --rho $rho --simplify $tsimplify --buffer --seed $SEED --nsteps $runtime --stats_json buffered.json
+            /usr/bin/time -f "%e %M" -o inplace.time ./wfbuffered --treefile inplace.trees --N $N --rho $rho --simplify $tsimplify --buffer --stitch_in_place --seed $SEED --nsteps $runtime --stats_json inplace.json
+            /usr/bin/time -f "%e %M" -o native.time ./wfbuffered --treefile native.trees --N $N --rho $rho --simplify $tsimplify --buffer --native_simplify --seed $SEED --nsteps $runtime --stats_json native.json
+            echo $N $rho "sort" $tsimplify `result classic` >> benchmarks.txt
+            echo $N $rho "radix" $tsimplify `result radix` >> benchmarks.txt
+            echo $N $rho "buffer" $tsimplify `result buffered` >> benchmarks.txt
+            echo $N $rho "buffer_in_place" $tsimplify `result inplace` >> benchmarks.txt
+            echo $N $rho "buffer_native" $tsimplify `result native` >> benchmarks.txt
+
+            # Untimed checks.  Both exit non-zero if the tables differ.
+            ./wfbuffered sweep --N $N --rho $rho --simplify $tsimplify --nsteps $runtime --seed $SEED --method sort radix buffer buffer_in_place buffer_native --output check.txt || exit 1
+            ./wfbuffered --treefile verify.trees --N $N --rho $rho --simplify $tsimplify --buffer --verify --seed $SEED --nsteps $runtime || exit 1
+        done
     done
 done
@@ -0,0 +1,395 @@
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include "buffered_simplifier.hpp"
+
+namespace
+{
+    const std::int64_t NONE = -1;
+
+    template <typename T>
+    std::size_t
+    capacity_bytes(const std::vector<T>& v)
+    {
+        return v.capacity() * sizeof(T);
+    }
+
+    void
+    add_ancestry(BufferedSimplifier& s, tsk_id_t input_id, double left, double right,
+                 tsk_id_t node)
+    {
+        auto tail = s.ancestry_tail[input_id];
+        if (tail != NONE && s.segments[tail].right == left
+            && s.segments[tail].node == node)
+            {
+                s.segments[tail].right = right;
+                return;
+            }
+        std::int64_t x = s.segments.size();
+        s.segments.push_back({left, right, node});
+        s.segment_next.push_back(NONE);
+        if (tail == NONE)
+            {
+                s.ancestry_head[input_id] = x;
+            }
+        else
+            {
+                s.segment_next[tail] = x;
+            }
+        s.ancestry_tail[input_id] = x;
+    }
+
+    tsk_id_t
+    record_node(BufferedSimplifier& s, const table_collection_ptr& tables,
+                tsk_id_t input_id, bool is_sample, std::vector<tsk_id_t>& node_map)
+    {
+        auto flags = tables->nodes.flags[input_id];
+        if (is_sample)
+            {
+                flags |= TSK_NODE_IS_SAMPLE;
+            }
+        else
+            {
+                flags &= ~TSK_NODE_IS_SAMPLE;
+            }
+        s.flags.push_back(flags);
+        s.time.push_back(tables->nodes.time[input_id]);
+        s.population.push_back(tables->nodes.population[input_id]);
+        s.individual.push_back(tables->nodes.individual[input_id]);
+        node_map[input_id] = static_cast<tsk_id_t>(s.flags.size() - 1);
+        return node_map[input_id];
+    }
+
+    void
+    rewind_node(BufferedSimplifier& s, tsk_id_t input_id,
+                std::vector<tsk_id_t>& node_map)
+    {
+        s.flags.pop_back();
+        s.time.pop_back();
+        s.population.pop_back();
+        s.individual.pop_back();
+        node_map[input_id] = TSK_NULL;
+    }
+
+    void
+    record_edge(BufferedSimplifier& s, double left, double right, tsk_id_t child)
+    // Adjacent intervals for the same child are squashed
+    {
+        auto tail = s.child_edge_tail[child];
+        if (tail == NONE)
+            {
+                s.buffered_children.push_back(child);
+                std::int64_t x = s.child_edges.size();
+                s.child_edges.push_back({left, right, NONE});
+                s.child_edge_head[child] = s.child_edge_tail[child] = x;
+            }
+        else if (s.child_edges[tail].right == left)
+            {
+                s.child_edges[tail].right = right;
+            }
+        else
+            {
+                std::int64_t x = s.child_edges.size();
+                s.child_edges.push_back({left, right, NONE});
+                s.child_edges[tail].next = x;
+                s.child_edge_tail[child] = x;
+            }
+    }
+
+    std::size_t
+    flush_edges(BufferedSimplifier& s, tsk_id_t output_parent)
+    // Output the edges of the current parent, sorted by child.
+    {
+        std::size_t n = 0;
+        std::sort(begin(s.buffered_children), end(s.buffered_children));
+        for (auto c : s.buffered_children)
+            {
+                for (auto e = s.child_edge_head[c]; e != NONE; e = s.child_edges[e].next)
+                    {
+                        s.left.push_back(s.child_edges[e].left);
+                        s.right.push_back(s.child_edges[e].right);
+                        s.parent.push_back(output_parent);
+                        s.child.push_back(c);
+                        ++n;
+                    }
+                s.child_edge_head[c] = s.child_edge_tail[c] = NONE;
+            }
+        s.buffered_children.clear();
+        s.child_edges.clear();
+        return n;
+    }
+
+    void
+    queue_overlapping_ancestry(BufferedSimplifier& s, double left, double right,
+                               tsk_id_t child)
+    {
+        for (auto x = s.ancestry_head[child]; x != NONE; x = s.segment_next[x])
+            {
+                const auto& seg = s.segments[x];
+                if (seg.right > left && right > seg.left)
+                    {
+                        s.queue.push_back({std::max(seg.left, left),
+                                           std::min(seg.right, right), seg.node});
+                    }
+            }
+    }
+
+    void
+    merge_ancestors(BufferedSimplifier& s, const table_collection_ptr& tables,
+                    tsk_id_t input_id, std::vector<tsk_id_t>& node_map)
+    // Process the segments in s.queue, which overlap the
+    // edges where input_id is the parent.
+    {
+        const double L = tables->sequence_length;
+        const bool is_sample = s.is_sample[input_id];
+        tsk_id_t output_id = node_map[input_id];
+        if (is_sample)
+            {
+                // Replace the ancestry of the sample
+                s.ancestry_head[input_id] = s.ancestry_tail[input_id] = NONE;
+            }
+        std::sort(begin(s.queue), end(s.queue),
+                  [](const BufferedSimplifier::Segment& a,
+                     const BufferedSimplifier::Segment& b) { return a.left < b.left; });
+        const std::size_t n = s.queue.size();
+        const double sentinel = std::numeric_limits<double>::max();
+        s.queue.push_back({sentinel, sentinel, TSK_NULL});
+        s.overlapping.clear();
+
+        std::size_t index = 0;
+        double left = 0., right = sentinel, prev_right = 0.;
+        while (true)
+            {
+                // Find the next interval [left, right) and the
+                // segments overlapping it.
+                if (index < n)
+                    {
+                        left = right;
+                        std::size_t k = 0;
+                        for (auto x : s.overlapping)
+                            {
+                                if (x->right > left)
+                                    {
+                                        s.overlapping[k++] = x;
+                                    }
+                            }
+                        s.overlapping.resize(k);
+                        if (k == 0)
+                            {
+                                left = s.queue[index].left;
+                            }
+                        while (index < n && s.queue[index].left == left)
+                            {
+                                s.overlapping.push_back(&s.queue[index]);
+                                ++index;
+                            }
+                        right = s.queue[index].left;
+                        for (auto x : s.overlapping)
+                            {
+                                right = std::min(right, x->right);
+                            }
+                    }
+                else
+                    {
+                        left = right;
+                        right = sentinel;
+                        std::size_t k = 0;
+                        for (auto x : s.overlapping)
+                            {
+                                if (x->right > left)
+                                    {
+                                        right = std::min(right, x->right);
+                                        s.overlapping[k++] = x;
+                                    }
+                            }
+                        s.overlapping.resize(k);
+                        if (k == 0)
+                            {
+                                break;
+                            }
+                    }
+
+                tsk_id_t ancestry_node;
+                if (s.overlapping.size() == 1)
+                    {
+                        ancestry_node = s.overlapping[0]->node;
+                        if (is_sample)
+                            {
+                                record_edge(s, left, right, ancestry_node);
+                                ancestry_node = output_id;
+                            }
+                    }
+                else
+                    {
+                        if (output_id == TSK_NULL)
+                            {
+                                output_id
+                                    = record_node(s, tables, input_id, false, node_map);
+                            }
+                        ancestry_node = output_id;
+                        for (auto x : s.overlapping)
+                            {
+                                record_edge(s, left, right, x->node);
+                            }
+                    }
+                if (is_sample && left != prev_right)
+                    {
+                        // Fill in gaps in the ancestry of the sample
+                        add_ancestry(s, input_id, prev_right, left, output_id);
+                    }
+                add_ancestry(s, input_id, left, right, ancestry_node);
+                prev_right = right;
+            }
+        if (is_sample && prev_right != L)
+            {
+                add_ancestry(s, input_id, prev_right, L, output_id);
+            }
+        if (output_id != TSK_NULL)
+            {
+                auto num_edges = flush_edges(s, output_id);
+                if (num_edges == 0 && !is_sample)
+                    {
+                        rewind_node(s, input_id, node_map);
+                    }
+            }
+        s.queue.clear();
+    }
+}
+
+BufferedSimplifier::BufferedSimplifier()
+    : ancestry_head{}, ancestry_tail{}, segment_next{}, segments{}, is_sample{},
+      processed{}, queue{}, overlapping{}, child_edge_head{}, child_edge_tail{},
+      child_edges{}, buffered_children{}, flags{}, time{}, population{}, individual{},
+      left{}, right{}, parent{}, child{}
+{
+}
+
+std::size_t
+buffered_simplifier_bytes(const BufferedSimplifier& s)
+{
+    return capacity_bytes(s.ancestry_head) + capacity_bytes(s.ancestry_tail)
+           + capacity_bytes(s.segment_next) + capacity_bytes(s.segments)
+           + capacity_bytes(s.is_sample) + capacity_bytes(s.processed)
+           + capacity_bytes(s.queue) + capacity_bytes(s.overlapping)
+           + capacity_bytes(s.child_edge_head) + capacity_bytes(s.child_edge_tail)
+           + capacity_bytes(s.child_edges) + capacity_bytes(s.buffered_children)
+           + capacity_bytes(s.flags) + capacity_bytes(s.time)
+           + capacity_bytes(s.population) + capacity_bytes(s.individual)
+           + capacity_bytes(s.left) + capacity_bytes(s.right) + capacity_bytes(s.parent)
+           + capacity_bytes(s.child);
+}
+
+void
+simplify_edge_buffer(const std::vector<tsk_id_t>& alive_at_last_simplification,
+                     const ParentEdgeIndex& index, double max_time,
+                     const std::vector<tsk_id_t>& samples, edge_buffer_ptr& new_edges,
+                     BufferedSimplifier& simplifier, std::vector<tsk_id_t>& node_map,
+                     SimulationStats* stats, table_collection_ptr& tables)
+{
+    StitchPlan plan;
+    {
+        PhaseTimer timer(stats, phase::stitch_find);
+        plan = plan_stitch(alive_at_last_simplification, index, max_time, new_edges,
+                           tables);
+    }
+    PhaseTimer timer(stats, phase::simplify);
+
+    auto& s = simplifier;
+    const std::size_t num_nodes = tables->nodes.num_rows;
+    s.ancestry_head.assign(num_nodes, NONE);
+    s.ancestry_tail.assign(num_nodes, NONE);
+    s.child_edge_head.assign(num_nodes, NONE);
+    s.child_edge_tail.assign(num_nodes, NONE);
+    s.is_sample.assign(num_nodes, 0);
+    s.processed.assign(num_nodes, 0);
+    s.segments.clear();
+    s.segment_next.clear();
+    s.flags.clear();
+    s.time.clear();
+    s.population.clear();
+    s.individual.clear();
+    s.left.clear();
+    s.right.clear();
+    s.parent.clear();
+    s.child.clear();
+    node_map.assign(num_nodes, TSK_NULL);
+
+    for (auto u : samples)
+        {
+            if (u < 0 || static_cast<std::size_t>(u) >= num_nodes || s.is_sample[u])
+                {
+                    throw std::invalid_argument("invalid or duplicated sample");
+                }
+            s.is_sample[u] = 1;
+            auto output_id = record_node(s, tables, u, true, node_map);
+            add_ancestry(s, u, 0., tables->sequence_length, output_id);
+        }
+
+    // Edges arrive in the order of the stitched edge table,
+    // so the edges of each parent are contiguous.
+    tsk_id_t current_parent = TSK_NULL;
+    auto input_edge = [&](double left, double right, tsk_id_t parent, tsk_id_t child) {
+        if (parent != current_parent)
+            {
+                if (current_parent != TSK_NULL)
+                    {
+                        merge_ancestors(s, tables, current_parent, node_map);
+                        if (tables->nodes.time[parent]
+                            < tables->nodes.time[current_parent])
+                            {
+                                throw std::runtime_error(
+                                    "edges not sorted by parent time");
+                            }
+                    }
+                if (s.processed[parent])
+                    {
+                        throw std::runtime_error("edges for parent are not contiguous");
+                    }
+                s.processed[parent] = 1;
+                current_parent = parent;
+            }
+        queue_overlapping_ancestry(s, left, right, child);
+    };
+    for (auto p : plan.new_parents)
+        {
+            visit_buffered_edges(new_edges, p, [&](const BirthData& b) {
+                input_edge(b.left, b.right, p, b.child);
+            });
+        }
+    const auto& edges = tables->edges;
+    std::size_t row = 0;
+    for (std::size_t i = 0; i < plan.alive_parents.size(); ++i)
+        {
+            for (; row < plan.insertion_points[i]; ++row)
+                {
+                    input_edge(edges.left[row], edges.right[row], edges.parent[row],
+                               edges.child[row]);
+                }
+            auto p = plan.alive_parents[i];
+            visit_buffered_edges(new_edges, p, [&](const BirthData& b) {
+                input_edge(b.left, b.right, p, b.child);
+            });
+        }
+    for (; row < edges.num_rows; ++row)
+        {
+            input_edge(edges.left[row], edges.right[row], edges.parent[row],
+                       edges.child[row]);
+        }
+    if (current_parent != TSK_NULL)
+        {
+            merge_ancestors(s, tables, current_parent, node_map);
+        }
+
+    int rv = tsk_node_table_set_columns(&tables->nodes, s.flags.size(), s.flags.data(),
+                                        s.time.data(), s.population.data(),
+                                        s.individual.data(), nullptr, nullptr);
+    if (rv == 0)
+        {
+            rv = tsk_edge_table_set_columns(&tables->edges, s.left.size(), s.left.data(),
+                                            s.right.data(), s.parent.data(),
+                                            s.child.data(), nullptr, nullptr);
+        }
+    handle_tskit_return_code(rv);
+    reset_edge_buffer(tables->nodes.num_rows, new_edges);
+}
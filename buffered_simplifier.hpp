@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <tskit.h>
+#include "tskit_tools.hpp"
+#include "edge_buffer.hpp"
+
+struct BufferedSimplifier
+// Simplification that reads the edge table and an EdgeBuffer
+// together, in the order given by plan_stitch, rather than
+// first stitching the buffer into the edge table.
+// This is the algorithm of Kelleher et al. (2018), as
+// implemented in fwdpp and tskit.  The node table, edge table,
+// and node map are the same as from stitch_together_edges
+// followed by tsk_table_collection_simplify.
+//
+// The members are working storage that we keep
+// to re-use their memory between simplifications.
+{
+    struct Segment
+    {
+        double left, right;
+        tsk_id_t node;
+    };
+
+    struct Interval
+    {
+        double left, right;
+        std::int64_t next;
+    };
+
+    // Ancestry of each input node: linked lists of segments
+    std::vector<std::int64_t> ancestry_head, ancestry_tail, segment_next;
+    std::vector<Segment> segments;
+    std::vector<char> is_sample, processed;
+
+    // Segments of ancestry overlapping the edges of the current parent
+    std::vector<Segment> queue;
+    std::vector<const Segment*> overlapping;
+
+    // Output edges of the current parent, listed per output child node
+    std::vector<std::int64_t> child_edge_head, child_edge_tail;
+    std::vector<Interval> child_edges;
+    std::vector<tsk_id_t> buffered_children;
+
+    // Output tables
+    std::vector<tsk_flags_t> flags;
+    std::vector<double> time;
+    std::vector<tsk_id_t> population, individual;
+    std::vector<double> left, right;
+    std::vector<tsk_id_t> parent, child;
+
+    BufferedSimplifier();
+};
+
+std::size_t buffered_simplifier_bytes(const BufferedSimplifier& simplifier);
+
+void simplify_edge_buffer(const std::vector<tsk_id_t>& alive_at_last_simplification,
+                          const ParentEdgeIndex& index, double max_time,
+                          const std::vector<tsk_id_t>& samples,
+                          edge_buffer_ptr& new_edges, BufferedSimplifier& simplifier,
+                          std::vector<tsk_id_t>& node_map, SimulationStats* stats,
+                          table_collection_ptr& tables);
@@ -0,0 +1,256 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include "checkpoint.hpp"
+
+namespace
+{
+    // The start of a state file.  The last character is the version.
+    const char STATE_MAGIC[8] = {'w', 'f', 'b', 's', 't', 'a', 't', '2'};
+
+    struct Snapshot
+    // What a checkpoint writes, copied from the simulation.
+    {
+        CheckpointState state;
+        std::string rng_name;
+        std::vector<char> rng_state;
+        table_collection_ptr tables;
+    };
+
+    template <typename T>
+    void
+    write_value(std::ostream& out, const T& value)
+    {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void
+    read_bytes(std::istream& in, char* bytes, std::size_t n)
+    {
+        in.read(bytes, static_cast<std::streamsize>(n));
+        if (!in)
+            {
+                throw std::runtime_error("checkpoint file is truncated");
+            }
+    }
+
+    template <typename T>
+    T
+    read_value(std::istream& in)
+    {
+        T value{};
+        read_bytes(in, reinterpret_cast<char*>(&value), sizeof(T));
+        return value;
+    }
+
+    void
+    rename_file(const std::string& from, const std::string& to)
+    {
+        if (std::rename(from.c_str(), to.c_str()) != 0)
+            {
+                throw std::runtime_error("could not rename " + from + " to " + to);
+            }
+    }
+
+    std::string
+    tables_path(const std::string& path, unsigned step)
+    {
+        return path + "." + std::to_string(step) + ".trees";
+    }
+
+    bool
+    read_header(std::istream& in, CheckpointState& state)
+    // Returns false if in does not start like a state file.
+    {
+        char magic[sizeof(STATE_MAGIC)];
+        std::uint32_t nsteps = 0, step = 0;
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char*>(&nsteps), sizeof(nsteps));
+        in.read(reinterpret_cast<char*>(&step), sizeof(step));
+        if (!in || std::memcmp(magic, STATE_MAGIC, sizeof(magic)) != 0)
+            {
+                return false;
+            }
+        state.nsteps = nsteps;
+        state.step = step;
+        return true;
+    }
+
+    void
+    write_snapshot(const std::string& path, Snapshot& s)
+    // The tables go to a new file, named by the state file, which
+    // replaces the last one once both are written.  Then the tables
+    // of the last checkpoint are removed.
+    {
+        std::string previous_tables;
+        {
+            std::ifstream in(path, std::ios::binary);
+            CheckpointState previous;
+            if (read_header(in, previous) && previous.step != s.state.step)
+                {
+                    previous_tables = tables_path(path, previous.step);
+                }
+        }
+
+        const auto tables = tables_path(path, s.state.step);
+        handle_tskit_return_code(tsk_table_collection_build_index(s.tables.get(), 0));
+        handle_tskit_return_code(
+            tsk_table_collection_dump(s.tables.get(), tables.c_str(), 0));
+
+        const auto state = path + ".tmp";
+        {
+            std::ofstream out(state, std::ios::binary);
+            if (!out)
+                {
+                    throw std::runtime_error("could not open " + state);
+                }
+            const auto& nodes = s.state.parent_nodes;
+            out.write(STATE_MAGIC, sizeof(STATE_MAGIC));
+            write_value(out, static_cast<std::uint32_t>(s.state.nsteps));
+            write_value(out, static_cast<std::uint32_t>(s.state.step));
+            write_value(out, static_cast<std::uint64_t>(s.tables->nodes.num_rows));
+            write_value(out, static_cast<std::uint64_t>(s.tables->edges.num_rows));
+            write_value(out, static_cast<std::uint64_t>(nodes.size()));
+            out.write(reinterpret_cast<const char*>(nodes.data()),
+                      nodes.size() * sizeof(tsk_id_t));
+            write_value(out, static_cast<std::uint64_t>(s.rng_name.size()));
+            out.write(s.rng_name.data(), s.rng_name.size());
+            write_value(out, static_cast<std::uint64_t>(s.rng_state.size()));
+            out.write(s.rng_state.data(), s.rng_state.size());
+            if (!out)
+                {
+                    throw std::runtime_error("could not write " + state);
+                }
+        }
+        rename_file(state, path);
+        if (previous_tables.empty() == false)
+            {
+                std::remove(previous_tables.c_str());
+            }
+    }
+}
+
+CheckpointWriter::CheckpointWriter(std::string path_)
+    : path{std::move(path_)}, pending{}
+{
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    if (pending.valid())
+        {
+            pending.wait();
+        }
+}
+
+bool
+CheckpointWriter::write(const CheckpointState& state, const GSLrng& rng,
+                        const table_collection_ptr& tables)
+// Only the node and edge tables are used by the simulation,
+// so we copy their columns, as for --async_simplify.
+// Waiting for a slow disk would stall the simulation, so
+// we skip this checkpoint instead, and take the next one.
+{
+    if (pending.valid()
+        && pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            return false;
+        }
+    // Rethrows the errors of the last write
+    wait();
+    Snapshot s{state, gsl_rng_name(rng.get()), {},
+               make_table_collection_ptr(tables->sequence_length)};
+    auto rng_state = static_cast<const char*>(gsl_rng_state(rng.get()));
+    s.rng_state.assign(rng_state, rng_state + gsl_rng_size(rng.get()));
+    const auto& nodes = tables->nodes;
+    handle_tskit_return_code(tsk_node_table_set_columns(
+        &s.tables->nodes, nodes.num_rows, nodes.flags, nodes.time, nodes.population,
+        nodes.individual, nullptr, nullptr));
+    const auto& edges = tables->edges;
+    handle_tskit_return_code(tsk_edge_table_set_columns(
+        &s.tables->edges, edges.num_rows, edges.left, edges.right, edges.parent,
+        edges.child, nullptr, nullptr));
+    pending = std::async(std::launch::async, [p = path, s = std::move(s)]() mutable {
+        write_snapshot(p, s);
+    });
+    return true;
+}
+
+void
+CheckpointWriter::wait()
+{
+    if (pending.valid())
+        {
+            pending.get();
+        }
+}
+
+CheckpointState
+read_checkpoint(const std::string& path, const GSLrng& rng,
+                table_collection_ptr& tables)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        {
+            throw std::runtime_error("could not open " + path);
+        }
+    CheckpointState state;
+    if (read_header(in, state) == false)
+        {
+            throw std::runtime_error(path + " is not a checkpoint");
+        }
+    auto num_nodes = read_value<std::uint64_t>(in);
+    auto num_edges = read_value<std::uint64_t>(in);
+    state.parent_nodes.resize(read_value<std::uint64_t>(in));
+    read_bytes(in, reinterpret_cast<char*>(state.parent_nodes.data()),
+               state.parent_nodes.size() * sizeof(tsk_id_t));
+    for (auto u : state.parent_nodes)
+        {
+            if (u < 0 || static_cast<std::uint64_t>(u) >= num_nodes)
+                {
+                    throw std::runtime_error("parent node out of range in " + path);
+                }
+        }
+    std::string rng_name(read_value<std::uint64_t>(in), '\0');
+    read_bytes(in, &rng_name[0], rng_name.size());
+    auto rng_size = read_value<std::uint64_t>(in);
+    if (rng_name != gsl_rng_name(rng.get()) || rng_size != gsl_rng_size(rng.get()))
+        {
+            throw std::runtime_error("the random number generator of " + path + " is not "
+                                     + gsl_rng_name(rng.get()));
+        }
+    std::vector<char> rng_state(rng_size);
+    read_bytes(in, rng_state.data(), rng_size);
+
+    const auto tables_file = tables_path(path, state.step);
+    tsk_table_collection_t loaded{};
+    int rv = tsk_table_collection_load(&loaded, tables_file.c_str(), 0);
+    if (rv == 0)
+        {
+            tables = make_table_collection_ptr(loaded.sequence_length);
+            rv = tsk_node_table_set_columns(
+                &tables->nodes, loaded.nodes.num_rows, loaded.nodes.flags,
+                loaded.nodes.time, loaded.nodes.population, loaded.nodes.individual,
+                nullptr, nullptr);
+        }
+    if (rv == 0)
+        {
+            rv = tsk_edge_table_set_columns(&tables->edges, loaded.edges.num_rows,
+                                            loaded.edges.left, loaded.edges.right,
+                                            loaded.edges.parent, loaded.edges.child,
+                                            nullptr, nullptr);
+        }
+    tsk_table_collection_free(&loaded);
+    handle_tskit_return_code(rv);
+    if (num_nodes != tables->nodes.num_rows || num_edges != tables->edges.num_rows)
+        {
+            throw std::runtime_error(tables_file + " does not match " + path);
+        }
+    std::memcpy(gsl_rng_state(rng.get()), rng_state.data(), rng_size);
+    return state;
+}
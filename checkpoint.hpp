@@ -0,0 +1,54 @@
+#pragma once
+
+#include <future>
+#include <string>
+#include <vector>
+#include <tskit.h>
+#include "rng.hpp"
+#include "tskit_tools.hpp"
+
+struct CheckpointState
+// The state of a simulation right after a simplification,
+// other than its tables and random number generator.
+// Buffered edges are empty then, and the nodes alive at the
+// last simplification are the parent nodes, so we do not
+// need to store them.
+{
+    // Node times count down from nsteps, so it
+    // must be the same when we resume.
+    unsigned nsteps;
+    // The last time step simulated
+    unsigned step;
+    // The two nodes of each individual, in order
+    std::vector<tsk_id_t> parent_nodes;
+};
+
+class CheckpointWriter
+// Writes checkpoints for --checkpoint on another thread.
+// The state file at path names a tables file, path + ".<step>.trees".
+// Each checkpoint writes a new tables file and then renames a new
+// state file over the old one, so that a crash while writing leaves
+// the last checkpoint in place.  A checkpoint due while the last one
+// is still being written is skipped.
+{
+  private:
+    std::string path;
+    std::future<void> pending;
+
+  public:
+    explicit CheckpointWriter(std::string path_);
+    // Waits for a write in progress, ignoring errors
+    ~CheckpointWriter();
+    // Copies the state and returns without waiting for the write.
+    // Returns false, and does nothing, if the last write is still
+    // in progress.
+    bool write(const CheckpointState& state, const GSLrng& rng,
+               const table_collection_ptr& tables);
+    // Waits for a write in progress, and rethrows its errors
+    void wait();
+};
+
+// Restores the tables and random number generator saved at path,
+// and returns the rest of the state.
+CheckpointState read_checkpoint(const std::string& path, const GSLrng& rng,
+                                table_collection_ptr& tables);
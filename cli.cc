@@ -1,9 +1,39 @@
 #include "cli.hpp"
 #include "options.hpp"
 #include <boost/program_options/value_semantic.hpp>
+#include <limits>
+#include <stdexcept>
+#include <string>
 
 namespace po = boost::program_options;
 
+static void
+parse_simplify_option(const std::string& s, command_line_options& o)
+{
+    if (s == "auto")
+        {
+            o.adaptive_simplification = true;
+            return;
+        }
+    std::size_t end = 0;
+    unsigned long interval = 0;
+    try
+        {
+            interval = std::stoul(s, &end);
+        }
+    catch (const std::exception&)
+        {
+            end = 0;
+        }
+    if (end == 0 || end != s.size() || s[0] == '-'
+        || interval > std::numeric_limits<unsigned>::max())
+        {
+            throw std::invalid_argument("simplify must be a number of time steps or auto");
+        }
+    o.adaptive_simplification = false;
+    o.simplification_interval = static_cast<unsigned>(interval);
+}
+
 po::options_description
 generate_main_options(command_line_options &o)
 {
@@ -19,10 +49,20 @@ generate_main_options(command_line_options &o)
                           po::value<decltype(command_line_options::nsteps)>(&o.nsteps),
                           "Number of time steps to evolve. Default = 1000.");
     options.add_options()(
-        "simplify",
-        po::value<decltype(command_line_options::simplification_interval)>(
-            &o.simplification_interval),
-        "Time steps between simplifications.  Default = 100.");
+        "simplify", po::value<std::string>()->notifier([&o](const std::string& s) {
+            parse_simplify_option(s, o);
+        }),
+        "Time steps between simplifications, or auto.  With auto, simplify when the "
+        "number of new edges reaches a threshold that is tuned as the simulation "
+        "runs, starting from the edges of 100 time steps.  Default = 100.");
+    options.add_options()(
+        "mem_budget",
+        po::value<decltype(command_line_options::mem_budget)>(&o.mem_budget),
+        "If > 0, also simplify whenever the rows of the node and edge tables and the "
+        "buffered births take up at least this many megabytes.  If the simplified "
+        "tables alone are over the budget, print a warning and simplify at 1.25 times "
+        "their size until they fit again.  Not used with --async_simplify.  "
+        "Default = 0.");
     options.add_options()("rho", po::value<decltype(command_line_options::rho)>(&o.rho),
                           "Scaled recombination rate, 4Nr.  Default=0.");
     options.add_options()(
@@ -32,15 +72,156 @@ generate_main_options(command_line_options &o)
         "buffer", po::bool_switch(&o.buffer_new_edges),
         "If true, use edge buffering algorithm. If not, sort and simplify. Default = "
         "false");
+    options.add_options()(
+        "stitch_in_place", po::bool_switch(&o.stitch_in_place),
+        "If true, and also using --buffer, stitch edges directly into the edge "
+        "table");
+    options.add_options()(
+        "native_simplify", po::bool_switch(&o.native_simplify),
+        "If true, and also using --buffer, simplify directly from the edge buffer "
+        "without first stitching it into the edge table");
+    options.add_options()(
+        "async_simplify", po::bool_switch(&o.async_simplify),
+        "If true, and also using --buffer, simplify on another thread while the next "
+        "interval is simulated");
+    options.add_options()(
+        "simplify_windows",
+        po::value<decltype(command_line_options::simplify_windows)>(
+            &o.simplify_windows),
+        "Split the genome into this many windows and simplify them in parallel, "
+        "using the threads given by --threads.  Does not change the output.  Cannot "
+        "be used with --native_simplify or --async_simplify.  Default = 1.");
+    options.add_options()(
+        "prune_interval",
+        po::value<decltype(command_line_options::prune_interval)>(&o.prune_interval),
+        "If > 0, and also using --buffer, remove buffered births whose child has no "
+        "living descendants every this many time steps.  Does not change the "
+        "output.  Default = 0.");
+    options.add_options()(
+        "compact_buffer", po::bool_switch(&o.compact_buffer),
+        "If true, and also using --buffer, store each buffered birth in 4 to 12 "
+        "bytes instead of 24: 4 bytes for the child, and 4 for each end that is not "
+        "an end of the genome.  With few crossovers per meiosis, this more than "
+        "halves the edge buffer's memory.  "
+        "Breakpoints are rounded down to a grid of 2^31 positions spanning the "
+        "genome.");
     options.add_options()("cppsort", po::bool_switch(&o.cppsort),
                           "If true, sort edges in C++.  Not used with --buffer");
     options.add_options()(
         "parallel_sort", po::bool_switch(&o.parallel_sort),
-        "If true, and also using --cppsort, sort edges with parallel method");
+        "If true, and also using --cppsort or --sort radix, sort edges with parallel "
+        "method, using the threads given by --threads");
+    options.add_options()(
+        "sort", po::value<decltype(command_line_options::sort_method)>(&o.sort_method),
+        "Edge sorting engine, comparison or radix.  The radix engine is always done "
+        "in C++.  Not used with --buffer.  Default = comparison.");
+    options.add_options()(
+        "incremental_sort", po::bool_switch(&o.incremental_sort),
+        "If true, only sort the edges added since the last simplification, and merge "
+        "them with the sorted edges.  Uses the engine given by --sort.  Not used with "
+        "--buffer");
+    options.add_options()(
+        "threads", po::value<decltype(command_line_options::nthreads)>(&o.nthreads),
+        "Number of threads used by every parallel part of the simulation:  "
+        "generating births, stitching buffered edges into the edge table, "
+        "--parallel_sort, and --simplify_windows.  Default = 1.");
+    options.add_options()(
+        "numa_node",
+        po::value<decltype(command_line_options::numa_node)>(&o.numa_node),
+        "If >= 0, run the threads given by --threads on this NUMA node.  Requires "
+        "TBB's hwloc support.  Default = -1, for no pinning.");
+    options.add_options()(
+        "counter_rng", po::bool_switch(&o.counter_rng),
+        "If true, use counter-based random numbers, so that results do not depend on "
+        "--threads.");
     options.add_options()("seed",
                           po::value<decltype(command_line_options::seed)>(&o.seed),
                           "Random number seed.  Default = 42.");
+    options.add_options()(
+        "stats_json",
+        po::value<decltype(command_line_options::stats_json)>(&o.stats_json),
+        "If given, time each phase of the simulation and write the timings and table "
+        "sizes at each simplification to this file as JSON.");
+    options.add_options()(
+        "verify", po::bool_switch(&o.verify),
+        "If true, and also using --buffer, run the simulation again with the same "
+        "seed, sorting and simplifying edges instead of buffering them, and check "
+        "that both give the same trees.  Exits with an error describing the first "
+        "difference along the genome if not.");
+    options.add_options()(
+        "checkpoint",
+        po::value<decltype(command_line_options::checkpoint)>(&o.checkpoint),
+        "If given, write the state of the simulation to this file every "
+        "--checkpoint_interval simplifications, so that the run can be continued "
+        "with --resume.  The simplified tables go to this file name with "
+        ".<step>.trees appended, and the tables of older checkpoints are removed.  "
+        "The files are written by another thread while the simulation goes on.  "
+        "If the last checkpoint is still being written, the next one is skipped, "
+        "and --stats_json counts it in skipped_checkpoints.  Cannot be used with --async_simplify.");
+    options.add_options()(
+        "checkpoint_interval",
+        po::value<decltype(command_line_options::checkpoint_interval)>(
+            &o.checkpoint_interval),
+        "Number of simplifications between checkpoints.  Default = 1.");
+    options.add_options()(
+        "resume", po::value<decltype(command_line_options::resume)>(&o.resume),
+        "Continue the simulation from this file, written by --checkpoint, rather "
+        "than from the first generation.  The other options must be the same as for "
+        "the run that wrote it, except that --simplify auto starts its tuning "
+        "again.");
 
     return options;
 }
 
+
+po::options_description
+generate_sweep_options(sweep_options &o)
+{
+    po::options_description options("Sweep options");
+    options.add_options()("help", "Display help");
+    options.add_options()(
+        "N", po::value<decltype(sweep_options::N)>(&o.N)->multitoken(),
+        "Diploid population sizes. Default = 1000.");
+    options.add_options()(
+        "psurvival",
+        po::value<decltype(sweep_options::psurvival)>(&o.psurvival)->multitoken(),
+        "Survival probabilities. Default = 0.0");
+    options.add_options()(
+        "rho", po::value<decltype(sweep_options::rho)>(&o.rho)->multitoken(),
+        "Scaled recombination rates, 4Nr.  Default=0.");
+    options.add_options()(
+        "nsteps", po::value<decltype(sweep_options::nsteps)>(&o.nsteps)->multitoken(),
+        "Numbers of time steps to evolve. Default = 1000.");
+    options.add_options()(
+        "simplify",
+        po::value<decltype(sweep_options::simplification_intervals)>(
+            &o.simplification_intervals)
+            ->multitoken(),
+        "Time steps between simplifications.  Default = 100.");
+    options.add_options()(
+        "method", po::value<decltype(sweep_options::methods)>(&o.methods)->multitoken(),
+        "Methods to run: sort, radix (--sort radix), buffer (--buffer), "
+        "buffer_in_place (--buffer --stitch_in_place), or buffer_native (--buffer "
+        "--native_simplify).  Default = sort.");
+    options.add_options()(
+        "threads", po::value<decltype(sweep_options::threads)>(&o.threads)->multitoken(),
+        "Numbers of threads for each run (--threads).  The results include the time "
+        "of each phase, so several values give the scaling of each phase.  Default = 1.");
+    options.add_options()(
+        "replicates",
+        po::value<decltype(sweep_options::replicates)>(&o.replicates),
+        "Number of runs of each combination of parameters and method.  Default = 1.");
+    options.add_options()("seed", po::value<decltype(sweep_options::seed)>(&o.seed),
+                          "Random number seed of the first replicate.  Replicate r uses "
+                          "seed + r for every combination.  Default = 42.");
+    options.add_options()(
+        "jobs", po::value<decltype(sweep_options::jobs)>(&o.jobs),
+        "Number of runs at a time.  Each run uses --threads threads, so more than "
+        "one job at a time must fit in the cores.  Default = 0, for the number of "
+        "cores divided by the largest --threads.");
+    options.add_options()(
+        "output", po::value<decltype(sweep_options::output)>(&o.output),
+        "Output file for the table of results.  Default = standard output.");
+
+    return options;
+}
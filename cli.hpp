@@ -3,7 +3,11 @@
 #include <boost/program_options.hpp>
 
 class command_line_options;
+struct sweep_options;
 
 boost::program_options::options_description
 generate_main_options(command_line_options &o);
 
+boost::program_options::options_description
+generate_sweep_options(sweep_options &o);
+
@@ -1,15 +1,28 @@
+#include <array>
 #include <vector>
 #include <tuple>
+#include <utility>
 #include <sstream>
 #include <limits>
 #include <algorithm>
 #include <stdexcept>
+#include <cstring>
+#include <cmath>
+#include <numeric>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 #include "edge_buffer.hpp"
 
 static const auto UMAX = std::numeric_limits<std::size_t>::max();
+// sort_buffered_parents scans all nodes, rather than sorting the
+// list of parents, if at least 1/SORTED_PARENTS_SCAN_FRACTION of
+// the nodes are new parents.
+static const std::size_t SORTED_PARENTS_SCAN_FRACTION = 16;
+// Runs of existing edges are copied in pieces of at most this
+// many rows by stitch_together_edges_in_parallel.
+static const std::size_t STITCH_PIECE_ROWS = 4096;
 
-BirthData::BirthData(double l, double r, tsk_id_t c)
-    : left{l}, right{r}, child{c}, next{NULL_EDGE_BUFFER_INDEX}
+BirthData::BirthData(double l, double r, tsk_id_t c) : left{l}, right{r}, child{c}
 {
     if (r <= l)
         {
@@ -17,89 +30,678 @@ BirthData::BirthData(double l, double r, tsk_id_t c)
         }
 }
 
-EdgeBuffer::EdgeBuffer(std::size_t num_nodes) : first(num_nodes, NULL_EDGE_BUFFER_INDEX), births{}
+EdgeBuffer::EdgeBuffer(std::size_t num_nodes)
+    : last(num_nodes, NULL_EDGE_BUFFER_INDEX), parents{}, num_sorted_parents{0}, next{},
+      fill{}, births{}, compact_units{}, position_scale{0.}, free_chunks{},
+      num_births{0}
 {
 }
 
+EdgeBuffer::EdgeBuffer(std::size_t num_nodes, double sequence_length)
+    : EdgeBuffer(num_nodes)
+{
+    if (sequence_length <= 0. || std::isfinite(sequence_length) == false)
+        {
+            throw std::invalid_argument("sequence_length must be > 0.0");
+        }
+    position_scale = sequence_length / COMPACT_POSITION_STEPS;
+}
+
+edge_buffer_ptr
+make_edge_buffer_ptr(std::size_t num_nodes, bool compact, double sequence_length)
+{
+    if (compact)
+        {
+            return edge_buffer_ptr(new EdgeBuffer(num_nodes, sequence_length));
+        }
+    return edge_buffer_ptr(new EdgeBuffer(num_nodes));
+}
+
+double
+compact_position(double x, double sequence_length)
+// The grid position at or below x, for 0 <= x < sequence_length.
+// Positions from here are stored exactly in CompactUnits.
+{
+    const double scale = sequence_length / COMPACT_POSITION_STEPS;
+    return std::floor(x / scale) * scale;
+}
+
+static std::uint32_t
+encode_position(double x, double scale)
+{
+    auto k = std::llround(x / scale);
+    if (k < 0 || static_cast<double>(k) > COMPACT_POSITION_STEPS
+        || static_cast<double>(k) * scale != x)
+        {
+            std::ostringstream o;
+            o << "position " << x << " is not on the grid of the compact edge buffer";
+            throw std::invalid_argument(o.str());
+        }
+    return static_cast<std::uint32_t>(k);
+}
+
+static CompactUnit
+encode_child(tsk_id_t parent, tsk_id_t child)
+// A child is born after its parent, so it has a larger node ID.
+{
+    const auto delta = static_cast<std::int64_t>(child) - parent;
+    if (delta <= 0 || delta > static_cast<std::int64_t>(COMPACT_CHILD_MASK))
+        {
+            std::ostringstream o;
+            o << "child " << child << " of parent " << parent
+              << " cannot be stored in the compact edge buffer";
+            throw std::invalid_argument(o.str());
+        }
+    return static_cast<CompactUnit>(delta);
+}
+
 ExistingEdges::ExistingEdges(tsk_id_t p, std::size_t start_, std::size_t stop_)
     : parent{p}, start{start_}, stop{stop_}
 {
 }
 
-EDGE_BUFFER_INDEX_TYPE
-get_buffer_end(const edge_buffer_ptr& new_edges, std::size_t i)
+static EDGE_BUFFER_INDEX_TYPE
+new_chunk(std::size_t size_class, EdgeBuffer& buffer)
+// An empty chunk of the size class, reusing a free
+// one before growing the arena.
 {
-    if (i >= new_edges->first.size())
+    auto& free_chunks = buffer.free_chunks[size_class];
+    if (free_chunks.empty() == false)
+        {
+            auto chunk = free_chunks.back();
+            free_chunks.pop_back();
+            chunk_next(buffer, chunk) = NULL_EDGE_BUFFER_INDEX;
+            return chunk;
+        }
+    const auto index = buffer.next[size_class].size();
+    constexpr auto max_index
+        = static_cast<std::size_t>(std::numeric_limits<EDGE_BUFFER_INDEX_TYPE>::max()
+                                   >> EDGE_BUFFER_SIZE_CLASS_BITS);
+    if (index > max_index)
+        {
+            throw std::runtime_error("too many chunks in the edge buffer");
+        }
+    buffer.next[size_class].push_back(NULL_EDGE_BUFFER_INDEX);
+    buffer.fill[size_class].push_back(0);
+    const auto arena_size = (index + 1) << size_class;
+    if (buffer.position_scale > 0.)
         {
-            throw std::runtime_error("invalid parent index");
+            buffer.compact_units[size_class].resize(arena_size);
         }
-    auto f = new_edges->first[i];
-    while (f != NULL_EDGE_BUFFER_INDEX && new_edges->births[f].next != NULL_EDGE_BUFFER_INDEX)
+    else
         {
-            f = new_edges->births[f].next;
-            if (f != NULL_EDGE_BUFFER_INDEX && f >= new_edges->births.size())
+            buffer.births[size_class].resize(arena_size);
+        }
+    return static_cast<EDGE_BUFFER_INDEX_TYPE>((index << EDGE_BUFFER_SIZE_CLASS_BITS)
+                                               | size_class);
+}
+
+static std::size_t
+append_slot(tsk_id_t parent, EdgeBuffer& buffer)
+// Returns where the next slot of parent is, in the arena of
+// the size class of its tail chunk.
+{
+    auto tail = buffer.last[parent];
+    if (tail == NULL_EDGE_BUFFER_INDEX
+        || chunk_fill(buffer, tail) == chunk_capacity(tail))
+        {
+            if (tail == NULL_EDGE_BUFFER_INDEX)
+                {
+                    tail = new_chunk(0, buffer);
+                    chunk_next(buffer, tail) = tail;
+                    buffer.parents.push_back(parent);
+                }
+            else
                 {
-                    throw std::runtime_error("invalid next value");
+                    // The second chunk is the size of the first,
+                    // and later ones double.
+                    const auto head = chunk_next(buffer, tail);
+                    std::size_t size_class = 0;
+                    if (tail != head)
+                        {
+                            size_class = std::min(chunk_size_class(tail) + 1,
+                                                  EDGE_BUFFER_NUM_SIZE_CLASSES - 1);
+                        }
+                    auto chunk = new_chunk(size_class, buffer);
+                    chunk_next(buffer, chunk) = head;
+                    chunk_next(buffer, tail) = chunk;
+                    tail = chunk;
                 }
+            buffer.last[parent] = tail;
         }
-    return f;
+    return chunk_start(tail) + chunk_fill(buffer, tail)++;
 }
 
 EDGE_BUFFER_INDEX_TYPE
 buffer_new_edge(tsk_id_t parent, double left, double right, tsk_id_t child,
                 edge_buffer_ptr& new_edges)
+// Returns the chunk where the birth ends.
 {
     if (parent == TSK_NULL || child == TSK_NULL)
         {
             throw std::runtime_error("bad node IDs passed to buffer_new_edge");
         }
-    if (parent >= new_edges->first.size())
+    if (parent >= new_edges->last.size())
         {
-            new_edges->first.resize(parent + 1, NULL_EDGE_BUFFER_INDEX);
+            new_edges->last.resize(parent + 1, NULL_EDGE_BUFFER_INDEX);
         }
-    new_edges->births.emplace_back(left, right, child);
-    if (new_edges->first[parent] == NULL_EDGE_BUFFER_INDEX)
+    auto& buffer = *new_edges;
+    if (buffer.position_scale > 0.)
         {
-            new_edges->first[parent] = new_edges->births.size() - 1;
-            if (new_edges->births[new_edges->first[parent]].next != NULL_EDGE_BUFFER_INDEX)
+            if (right <= left)
+                {
+                    throw std::invalid_argument("BirthData: right <= left");
+                }
+            const double scale = buffer.position_scale;
+            const auto l = encode_position(left, scale);
+            const auto r = encode_position(right, scale);
+            std::array<CompactUnit, 3> units;
+            std::size_t n = 1;
+            units[0] = encode_child(parent, child);
+            if (l != 0)
+                {
+                    units[0] |= COMPACT_HAS_LEFT;
+                    units[n++] = l;
+                }
+            if (r != static_cast<std::uint32_t>(COMPACT_POSITION_STEPS))
+                {
+                    units[0] |= COMPACT_HAS_RIGHT;
+                    units[n++] = r;
+                }
+            for (std::size_t i = 0; i < n; ++i)
                 {
-                    std::ostringstream o;
-                    o << "invalid next entry for first birth: " << parent << ' '
-                      << new_edges->first[parent] << ' '
-                      << new_edges->births[new_edges->first[parent]].next << ' '
-                      << new_edges->first.size() << ' ' << new_edges->births.size();
-                    throw std::runtime_error(o.str());
+                    const auto loc = append_slot(parent, buffer);
+                    buffer.compact_units[chunk_size_class(buffer.last[parent])][loc]
+                        = units[i];
                 }
         }
     else
         {
-            auto l = get_buffer_end(new_edges, parent);
-            new_edges->births[l].next = new_edges->births.size() - 1;
+            BirthData birth(left, right, child);
+            const auto loc = append_slot(parent, buffer);
+            buffer.births[chunk_size_class(buffer.last[parent])][loc] = birth;
         }
-    return new_edges->births.size() - 1;
+    ++buffer.num_births;
+    return buffer.last[parent];
 }
 
-EDGE_BUFFER_INDEX_TYPE
-buffer_new_edge_at(EDGE_BUFFER_INDEX_TYPE loc, double left, double right, tsk_id_t child,
-               edge_buffer_ptr& new_edges)
+template <typename T>
+static void
+clear_each(per_size_class<T>& v)
+{
+    for (auto& x : v)
+        {
+            x.clear();
+        }
+}
+
+void
+reset_edge_buffer(std::size_t num_nodes, edge_buffer_ptr& new_edges)
+// Empty the buffer, keeping the memory allocated.
+// Only the entries of parents with births are cleared.
+{
+    for (auto p : new_edges->parents)
+        {
+            new_edges->last[p] = NULL_EDGE_BUFFER_INDEX;
+        }
+    new_edges->parents.clear();
+    new_edges->num_sorted_parents = 0;
+    new_edges->last.resize(num_nodes, NULL_EDGE_BUFFER_INDEX);
+    clear_each(new_edges->next);
+    clear_each(new_edges->fill);
+    clear_each(new_edges->births);
+    clear_each(new_edges->compact_units);
+    clear_each(new_edges->free_chunks);
+    new_edges->num_births = 0;
+}
+
+std::size_t
+num_buffered_edges(const edge_buffer_ptr& new_edges)
+{
+    return new_edges->num_births;
+}
+
+template <typename Vector>
+static std::size_t
+capacity_bytes(const Vector& v)
+{
+    return v.capacity() * sizeof(typename Vector::value_type);
+}
+
+template <typename Vector>
+static std::size_t
+capacity_bytes(const per_size_class<Vector>& v)
+{
+    std::size_t rv = 0;
+    for (auto& x : v)
+        {
+            rv += capacity_bytes(x);
+        }
+    return rv;
+}
+
+std::size_t
+edge_buffer_bytes(const edge_buffer_ptr& new_edges)
+{
+    if (new_edges == nullptr)
+        {
+            return 0;
+        }
+    return capacity_bytes(new_edges->last) + capacity_bytes(new_edges->parents)
+           + capacity_bytes(new_edges->next)
+           + capacity_bytes(new_edges->fill) + capacity_bytes(new_edges->births)
+           + capacity_bytes(new_edges->compact_units)
+           + capacity_bytes(new_edges->free_chunks);
+}
+
+template <typename Vector>
+static std::size_t
+size_bytes(const Vector& v)
+{
+    return v.size() * sizeof(typename Vector::value_type);
+}
+
+template <typename Vector>
+static std::size_t
+size_bytes(const per_size_class<Vector>& v)
+{
+    std::size_t rv = 0;
+    for (auto& x : v)
+        {
+            rv += size_bytes(x);
+        }
+    return rv;
+}
+
+std::size_t
+edge_buffer_bytes_in_use(const edge_buffer_ptr& new_edges)
+// The same parts as edge_buffer_bytes, counting sizes rather
+// than capacities, so that it goes down when the buffer is
+// emptied.  Empty slots in chunks are counted.
+{
+    if (new_edges == nullptr)
+        {
+            return 0;
+        }
+    return size_bytes(new_edges->last) + size_bytes(new_edges->parents)
+           + size_bytes(new_edges->next) + size_bytes(new_edges->fill)
+           + size_bytes(new_edges->births) + size_bytes(new_edges->compact_units)
+           + size_bytes(new_edges->free_chunks);
+}
+
+std::size_t
+temp_edges_bytes(const temp_edges& edges)
+{
+    return capacity_bytes(edges.left) + capacity_bytes(edges.right)
+           + capacity_bytes(edges.parent) + capacity_bytes(edges.child);
+}
+
+static void
+sort_buffered_parents(EdgeBuffer& buffer)
+// For the functions that visit parents in order of node ID.
+// Parents added since the last call are sorted and merged in.
+// When a large fraction of nodes are new parents, as without
+// overlapping generations, a pass over first is faster.
+{
+    auto& parents = buffer.parents;
+    const auto num_unsorted = parents.size() - buffer.num_sorted_parents;
+    if (num_unsorted * SORTED_PARENTS_SCAN_FRACTION < buffer.last.size())
+        {
+            auto middle = begin(parents) + buffer.num_sorted_parents;
+            std::sort(middle, end(parents));
+            std::inplace_merge(begin(parents), middle, end(parents));
+        }
+    else
+        {
+            parents.clear();
+            for (std::size_t p = 0; p < buffer.last.size(); ++p)
+                {
+                    if (buffer.last[p] != NULL_EDGE_BUFFER_INDEX)
+                        {
+                            parents.push_back(static_cast<tsk_id_t>(p));
+                        }
+                }
+        }
+    buffer.num_sorted_parents = parents.size();
+}
+
+static std::pair<EDGE_BUFFER_INDEX_TYPE, std::size_t>
+keep_live_births(std::size_t parent, const std::vector<std::uint8_t>& is_live,
+                 EdgeBuffer& buffer, std::size_t& removed)
+// Move the births with live children in the chunks of parent
+// to the front of those chunks.  Returns the last chunk
+// written to and the number of births in it.
+{
+    auto& births = buffer.births;
+    auto out_chunk = first_chunk(buffer, parent);
+    std::size_t out_fill = 0;
+    for (auto c = out_chunk; c != NULL_EDGE_BUFFER_INDEX;
+         c = following_chunk(buffer, parent, c))
+        {
+            auto b = begin(births[chunk_size_class(c)]) + chunk_start(c);
+            auto e = b + chunk_fill(buffer, c);
+            for (; b < e; ++b)
+                {
+                    if (is_live[b->child] == 0)
+                        {
+                            ++removed;
+                            continue;
+                        }
+                    if (out_fill == chunk_capacity(out_chunk))
+                        {
+                            chunk_fill(buffer, out_chunk) = out_fill;
+                            out_chunk = chunk_next(buffer, out_chunk);
+                            out_fill = 0;
+                        }
+                    births[chunk_size_class(out_chunk)]
+                          [chunk_start(out_chunk) + out_fill]
+                        = *b;
+                    ++out_fill;
+                }
+        }
+    return {out_chunk, out_fill};
+}
+
+static std::pair<EDGE_BUFFER_INDEX_TYPE, std::size_t>
+keep_live_compact_births(std::size_t parent, const std::vector<std::uint8_t>& is_live,
+                         EdgeBuffer& buffer, std::size_t& removed)
+// As keep_live_births, for CompactUnits.  We read all units of
+// a birth before writing it, so writing never gets ahead of
+// reading.  Returns the last chunk written to and the number
+// of units in it.
+{
+    auto& units = buffer.compact_units;
+    auto out_chunk = first_chunk(buffer, parent);
+    std::size_t out_fill = 0;
+    std::array<CompactUnit, 3> birth;
+    std::size_t n = 0, birth_units = 0;
+    for (auto c = out_chunk; c != NULL_EDGE_BUFFER_INDEX;
+         c = following_chunk(buffer, parent, c))
+        {
+            auto b = begin(units[chunk_size_class(c)]) + chunk_start(c);
+            auto e = b + chunk_fill(buffer, c);
+            for (; b < e; ++b)
+                {
+                    if (n == 0)
+                        {
+                            birth_units = compact_birth_units(*b);
+                        }
+                    birth[n++] = *b;
+                    if (n < birth_units)
+                        {
+                            continue;
+                        }
+                    n = 0;
+                    if (is_live[parent + (birth[0] & COMPACT_CHILD_MASK)] == 0)
+                        {
+                            ++removed;
+                            continue;
+                        }
+                    for (std::size_t i = 0; i < birth_units; ++i)
+                        {
+                            if (out_fill == chunk_capacity(out_chunk))
+                                {
+                                    chunk_fill(buffer, out_chunk) = out_fill;
+                                    out_chunk = chunk_next(buffer, out_chunk);
+                                    out_fill = 0;
+                                }
+                            units[chunk_size_class(out_chunk)]
+                                 [chunk_start(out_chunk) + out_fill]
+                                = birth[i];
+                            ++out_fill;
+                        }
+                }
+        }
+    return {out_chunk, out_fill};
+}
+
+std::size_t
+prune_edge_buffer(const std::vector<tsk_id_t>& alive, std::size_t num_nodes,
+                  std::vector<std::uint8_t>& is_live, edge_buffer_ptr& new_edges)
+// Remove the births whose child has no descendants among the alive
+// nodes, and return how many were removed.  Such births do not
+// affect the result of simplifying with the alive nodes as samples.
+//
+// A child is always born after its parent, so it has a larger node
+// ID.  Going through parents from the largest ID down, we therefore
+// know whether each child is live before we reach its parents.
+// A parent is live if it is alive or if it keeps any births.
+//
+// The kept births of each parent are moved to the front of its
+// chunks, keeping their order, and chunks that are no longer
+// needed go to new_edges->free_chunks.  num_nodes is the number
+// of rows in the node table, and is_live is working storage.
 {
-    if(loc>= new_edges->births.size()) { throw std::runtime_error("bad location"); }
-    new_edges->births.emplace_back(left, right, child);
-    new_edges->births[loc].next = new_edges->births.size() - 1;
-    return new_edges->births.size() - 1;
+    is_live.assign(num_nodes, 0);
+    for (auto a : alive)
+        {
+            is_live[a] = 1;
+        }
+    std::size_t removed = 0;
+    sort_buffered_parents(*new_edges);
+    auto& parents = new_edges->parents;
+    auto kept_parent = parents.end();
+    for (auto i = parents.rbegin(); i < parents.rend(); ++i)
+        {
+            const auto parent = *i;
+            const auto tail = new_edges->last[parent];
+            const auto head = chunk_next(*new_edges, tail);
+            auto kept = new_edges->position_scale > 0.
+                            ? keep_live_compact_births(parent, is_live, *new_edges,
+                                                       removed)
+                            : keep_live_births(parent, is_live, *new_edges, removed);
+            auto out_chunk = kept.first;
+            auto out_fill = kept.second;
+            // Chunks after out_chunk are now empty.  If no births were
+            // kept, then out_chunk is empty too.
+            auto c = out_chunk == tail ? NULL_EDGE_BUFFER_INDEX
+                                       : chunk_next(*new_edges, out_chunk);
+            if (out_fill == 0)
+                {
+                    c = out_chunk;
+                    new_edges->last[parent] = NULL_EDGE_BUFFER_INDEX;
+                }
+            else
+                {
+                    is_live[parent] = 1;
+                    chunk_fill(*new_edges, out_chunk) = out_fill;
+                    chunk_next(*new_edges, out_chunk) = head;
+                    new_edges->last[parent] = out_chunk;
+                    *--kept_parent = parent;
+                }
+            while (c != NULL_EDGE_BUFFER_INDEX)
+                {
+                    auto n = c == tail ? NULL_EDGE_BUFFER_INDEX
+                                       : chunk_next(*new_edges, c);
+                    chunk_fill(*new_edges, c) = 0;
+                    chunk_next(*new_edges, c) = NULL_EDGE_BUFFER_INDEX;
+                    new_edges->free_chunks[chunk_size_class(c)].push_back(c);
+                    c = n;
+                }
+        }
+    parents.erase(parents.begin(), kept_parent);
+    new_edges->num_sorted_parents = parents.size();
+    new_edges->num_births -= removed;
+    return removed;
+}
+
+void
+merge_edge_buffers(std::vector<edge_buffer_ptr>& shards, edge_buffer_ptr& new_edges)
+// Move the births in shards into new_edges, and empty the shards.
+// Each shard holds the births from one contiguous block of each
+// generation. Child node IDs increase in birth order, so sorting
+// a parent's births by child restores the order in which they would
+// have been buffered by a single thread.  The sort is stable because
+// the edges of a child with a given parent are all in one shard,
+// ordered by left.
+{
+    std::vector<tsk_id_t> parents;
+    for (auto& shard : shards)
+        {
+            parents.insert(end(parents), begin(shard->parents), end(shard->parents));
+        }
+    std::sort(begin(parents), end(parents));
+    parents.erase(std::unique(begin(parents), end(parents)), end(parents));
+    std::vector<BirthData> births;
+    for (auto parent : parents)
+        {
+            births.clear();
+            std::size_t nshards = 0;
+            for (auto& shard : shards)
+                {
+                    if (static_cast<std::size_t>(parent) < shard->last.size()
+                        && shard->last[parent] != NULL_EDGE_BUFFER_INDEX)
+                        {
+                            ++nshards;
+                            visit_buffered_edges(shard, parent,
+                                                 [&births](const BirthData& b) {
+                                                     births.push_back(b);
+                                                 });
+                        }
+                }
+            if (nshards > 1)
+                {
+                    std::stable_sort(begin(births), end(births),
+                                     [](const BirthData& lhs, const BirthData& rhs) {
+                                         return lhs.child < rhs.child;
+                                     });
+                }
+            for (auto& b : births)
+                {
+                    buffer_new_edge(parent, b.left, b.right, b.child, new_edges);
+                }
+        }
+    for (auto& shard : shards)
+        {
+            reset_edge_buffer(new_edges->last.size(), shard);
+        }
+}
+
+static void
+remap_children(const std::vector<tsk_id_t>& node_map,
+               const per_size_class<std::vector<std::uint8_t>>& fill,
+               per_size_class<birth_arena<BirthData>>& births)
+{
+    for (std::size_t s = 0; s < EDGE_BUFFER_NUM_SIZE_CLASSES; ++s)
+        {
+            for (std::size_t chunk = 0; chunk < fill[s].size(); ++chunk)
+                {
+                    auto b = begin(births[s]) + (chunk << s);
+                    auto e = b + fill[s][chunk];
+                    for (; b < e; ++b)
+                        {
+                            b->child = node_map[b->child];
+                        }
+                }
+        }
+}
+
+static void
+remap_compact_children(tsk_id_t parent, tsk_id_t new_parent,
+                       const std::vector<tsk_id_t>& node_map, EdgeBuffer& buffer)
+// Compact children are stored relative to their parent,
+// so this is done before the parent is relabelled.
+{
+    std::size_t remaining = 0;
+    visit_compact_units(buffer, parent, [&](CompactUnit& u) {
+        if (remaining > 0)
+            {
+                --remaining;
+                return;
+            }
+        remaining = compact_birth_units(u) - 1;
+        const auto child
+            = node_map[parent + static_cast<tsk_id_t>(u & COMPACT_CHILD_MASK)];
+        u = (u & ~COMPACT_CHILD_MASK) | encode_child(new_parent, child);
+    });
+}
+
+void
+remap_edge_buffer(const std::vector<tsk_id_t>& node_map, std::size_t num_nodes,
+                  edge_buffer_ptr& new_edges)
+// Relabel the parents and children of all buffered births,
+// for a node table that now has num_nodes rows.  Births
+// stay in their chunks, and we only move the list tails.  The
+// map must be increasing for children, so that each parent's
+// births stay sorted by child.
+{
+    auto& parents = new_edges->parents;
+    std::vector<EDGE_BUFFER_INDEX_TYPE> tails;
+    tails.reserve(parents.size());
+    for (auto& parent : parents)
+        {
+            const auto new_parent = node_map[parent];
+            if (new_parent == TSK_NULL
+                || static_cast<std::size_t>(new_parent) >= num_nodes)
+                {
+                    throw std::runtime_error("buffered parent has no output node");
+                }
+            if (new_edges->position_scale > 0.)
+                {
+                    remap_compact_children(parent, new_parent, node_map, *new_edges);
+                }
+            tails.push_back(new_edges->last[parent]);
+            new_edges->last[parent] = NULL_EDGE_BUFFER_INDEX;
+            parent = new_parent;
+        }
+    // The map need not keep parents in order
+    new_edges->num_sorted_parents = 0;
+    new_edges->last.resize(num_nodes, NULL_EDGE_BUFFER_INDEX);
+    for (std::size_t i = 0; i < parents.size(); ++i)
+        {
+            new_edges->last[parents[i]] = tails[i];
+        }
+    if (new_edges->position_scale == 0.)
+        {
+            remap_children(node_map, new_edges->fill, new_edges->births);
+        }
+}
+
+void
+index_parent_edges(const table_collection_ptr& tables,
+                   const std::vector<tsk_id_t>& alive_at_last_simplification,
+                   ParentEdgeIndex& index)
+// Call right after simplifying.  The edge table is sorted by parent
+// time, so the edges of the alive nodes are all within the rows
+// whose parent is no older than the oldest alive node.
+// After simplification, the alive nodes are the first nodes
+// in the node table, so the index stays small.
+{
+    tsk_id_t max_node = -1;
+    double max_time = std::numeric_limits<double>::lowest();
+    for (auto a : alive_at_last_simplification)
+        {
+            max_node = std::max(max_node, a);
+            max_time = std::max(max_time, tables->nodes.time[a]);
+        }
+    index.start.assign(max_node + 1, UMAX);
+    index.stop.assign(max_node + 1, UMAX);
+    for (decltype(tables->edges.num_rows) i = 0;
+         i < tables->edges.num_rows
+         && tables->nodes.time[tables->edges.parent[i]] <= max_time;
+         ++i)
+        {
+            auto p = tables->edges.parent[i];
+            if (p <= max_node)
+                {
+                    if (index.start[p] == UMAX)
+                        {
+                            index.start[p] = i;
+                        }
+                    index.stop[p] = i + 1;
+                }
+        }
 }
 
 std::vector<ExistingEdges>
 find_pre_existing_edges(const table_collection_ptr& tables,
                         const std::vector<tsk_id_t>& alive_at_last_simplification,
-                        const edge_buffer_ptr& new_edges)
-// FIXME: the indexing step need go no farther than the time of the most
-// recent node in alive_at_last_simplification.
+                        const ParentEdgeIndex& index, const edge_buffer_ptr& new_edges)
 {
     std::vector<tsk_id_t> alive_with_new_edges;
     for (auto a : alive_at_last_simplification)
         {
-            if (new_edges->first[a] != NULL_EDGE_BUFFER_INDEX)
+            if (new_edges->last[a] != NULL_EDGE_BUFFER_INDEX)
                 {
                     alive_with_new_edges.push_back(a);
                 }
@@ -108,28 +710,11 @@ find_pre_existing_edges(const table_collection_ptr& tables,
         {
             return {};
         }
-    // index where each node already has edges.
-    std::vector<std::size_t> starts(tables->nodes.num_rows, UMAX),
-        stops(tables->nodes.num_rows, UMAX);
-    for (decltype(tables->edges.num_rows) i = 0; i < tables->edges.num_rows; ++i)
-        {
-            if (starts[tables->edges.parent[i]] == UMAX)
-                {
-                    starts[tables->edges.parent[i]] = i;
-                    stops[tables->edges.parent[i]]
-                        = i; // FIXME: idiomatically, this should be i+1
-                }
-            else
-                {
-                    stops[tables->edges.parent[i]]
-                        = i; // FIXME: idiomatically, this should be i+1
-                }
-        }
 
     std::vector<ExistingEdges> existing_edges;
     for (auto a : alive_with_new_edges)
         {
-            existing_edges.emplace_back(a, starts[a], stops[a]);
+            existing_edges.emplace_back(a, index.start[a], index.stop[a]);
         }
 
     // Our only sort!!
@@ -186,30 +771,23 @@ handle_pre_existing_edges(const table_collection_ptr& tables,
                                                    tables->edges.child[offset]);
                             ++offset;
                         }
-                    // FIXME: stop condition isn't idiomatic
-                    for (decltype(ex.start) i = ex.start; i < ex.stop + 1; ++i)
+                    for (decltype(ex.start) i = ex.start; i < ex.stop; ++i)
                         {
                             edge_liftover.add_edge(
                                 tables->edges.left[i], tables->edges.right[i],
                                 tables->edges.parent[i], tables->edges.child[i]);
                         }
-                    // NOTE: differs from python, so could be a source of error
-                    offset = ex.stop + 1;
-                }
-            auto n = new_edges->first[ex.parent];
-            while (n != NULL_EDGE_BUFFER_INDEX)
-                {
-                    edge_liftover.add_edge(new_edges->births[n].left,
-                                           new_edges->births[n].right, ex.parent,
-                                           new_edges->births[n].child);
-                    n = new_edges->births[n].next;
+                    offset = ex.stop;
                 }
+            visit_buffered_edges(new_edges, ex.parent, [&](const BirthData& b) {
+                edge_liftover.add_edge(b.left, b.right, ex.parent, b.child);
+            });
         }
     return offset;
 }
 
 void
-copy_births_since_last_simplification(const edge_buffer_ptr& new_edges,
+copy_births_since_last_simplification(edge_buffer_ptr& new_edges,
                                       const table_collection_ptr& tables,
                                       double max_time, temp_edges& edge_liftover)
 {
@@ -221,37 +799,39 @@ copy_births_since_last_simplification(const edge_buffer_ptr& new_edges,
     // to our temporary edge table if they are newer
     // than the last simplification time
 
-    for (auto b = new_edges->first.rbegin(); b < new_edges->first.rend(); ++b)
+    sort_buffered_parents(*new_edges);
+    const auto& parents = new_edges->parents;
+    for (auto b = parents.rbegin(); b < parents.rend(); ++b)
         {
-            auto d = std::distance(new_edges->first.rbegin(), b);
-            auto parent = new_edges->first.size() - d - 1;
-            auto ptime = tables->nodes.time[parent];
-            if (*b != NULL_EDGE_BUFFER_INDEX && ptime < max_time)
-                {
-                    auto n = *b;
-                    while (n != NULL_EDGE_BUFFER_INDEX)
-                        {
-                            edge_liftover.add_edge(new_edges->births[n].left,
-                                                   new_edges->births[n].right, parent,
-                                                   new_edges->births[n].child);
-                            n = new_edges->births[n].next;
-                        }
-                }
-            else if (*b != NULL_EDGE_BUFFER_INDEX and ptime >= max_time)
+            auto parent = *b;
+            if (tables->nodes.time[parent] >= max_time)
                 {
                     break;
                 }
+            visit_buffered_edges(new_edges, parent, [&](const BirthData& birth) {
+                edge_liftover.add_edge(birth.left, birth.right, parent, birth.child);
+            });
         }
 }
 
 void
 stitch_together_edges(const std::vector<tsk_id_t>& alive_at_last_simplification,
-                      double max_time, edge_buffer_ptr& new_edges,
-                      temp_edges& edge_liftover, table_collection_ptr& tables)
+                      const ParentEdgeIndex& index, double max_time,
+                      edge_buffer_ptr& new_edges, temp_edges& edge_liftover,
+                      SimulationStats* stats, table_collection_ptr& tables)
 {
-    copy_births_since_last_simplification(new_edges, tables, max_time, edge_liftover);
-    auto existing_edges
-        = find_pre_existing_edges(tables, alive_at_last_simplification, new_edges);
+    {
+        PhaseTimer timer(stats, phase::stitch_copy);
+        copy_births_since_last_simplification(new_edges, tables, max_time,
+                                              edge_liftover);
+    }
+    std::vector<ExistingEdges> existing_edges;
+    {
+        PhaseTimer timer(stats, phase::stitch_find);
+        existing_edges = find_pre_existing_edges(tables, alive_at_last_simplification,
+                                                 index, new_edges);
+    }
+    PhaseTimer timer(stats, phase::stitch_handle);
     auto offset
         = handle_pre_existing_edges(tables, new_edges, existing_edges, edge_liftover);
     for (; offset < tables->edges.num_rows; ++offset)
@@ -260,14 +840,297 @@ stitch_together_edges(const std::vector<tsk_id_t>& alive_at_last_simplification,
                 tables->edges.left[offset], tables->edges.right[offset],
                 tables->edges.parent[offset], tables->edges.child[offset]);
         }
-    int ret = tsk_edge_table_set_columns(
+    handle_tskit_return_code(tsk_edge_table_set_columns(
         &tables->edges, edge_liftover.size(), edge_liftover.left.data(),
         edge_liftover.right.data(), edge_liftover.parent.data(),
-        edge_liftover.child.data(), nullptr, 0);
+        edge_liftover.child.data(), nullptr, 0));
     // This resets sizes to 0, but keeps the memory allocated.
     edge_liftover.clear();
-    // TODO: move this cleanup to function
-    new_edges->first.resize(tables->nodes.num_rows);
-    std::fill(begin(new_edges->first), end(new_edges->first), NULL_EDGE_BUFFER_INDEX);
-    new_edges->births.clear();
+    reset_edge_buffer(tables->nodes.num_rows, new_edges);
+}
+
+static std::size_t
+num_buffered_edges(const edge_buffer_ptr& new_edges, std::size_t parent)
+{
+    std::size_t n = 0;
+    if (new_edges->position_scale > 0.)
+        {
+            visit_buffered_edges(new_edges, parent, [&n](const BirthData&) { ++n; });
+            return n;
+        }
+    for (auto c = first_chunk(*new_edges, parent); c != NULL_EDGE_BUFFER_INDEX;
+         c = following_chunk(*new_edges, parent, c))
+        {
+            n += chunk_fill(*new_edges, c);
+        }
+    return n;
+}
+
+static std::vector<std::size_t>
+find_insertion_points(const table_collection_ptr& tables,
+                      const std::vector<ExistingEdges>& existing_edges)
+// For each element of existing_edges, the edge table row before
+// which its buffered edges go.  This is the same walk through the
+// edge table as in handle_pre_existing_edges.
+{
+    std::vector<std::size_t> rv;
+    decltype(tables->edges.num_rows) offset = 0;
+    for (const auto& ex : existing_edges)
+        {
+            while (offset < tables->edges.num_rows
+                   && tables->nodes.time[tables->edges.parent[offset]]
+                          < tables->nodes.time[ex.parent])
+                {
+                    ++offset;
+                }
+            if (ex.start != UMAX)
+                {
+                    if (offset > ex.start)
+                        {
+                            throw std::runtime_error("existing edges out of order");
+                        }
+                    offset = ex.stop;
+                }
+            rv.push_back(offset);
+        }
+    return rv;
+}
+
+static void
+move_edge_rows(tsk_edge_table_t& edges, std::size_t from, std::size_t to, std::size_t n)
+{
+    std::memmove(edges.left + to, edges.left + from, n * sizeof(double));
+    std::memmove(edges.right + to, edges.right + from, n * sizeof(double));
+    std::memmove(edges.parent + to, edges.parent + from, n * sizeof(tsk_id_t));
+    std::memmove(edges.child + to, edges.child + from, n * sizeof(tsk_id_t));
+}
+
+static std::size_t
+write_buffered_edges(const edge_buffer_ptr& new_edges, tsk_id_t parent, std::size_t row,
+                     tsk_edge_table_t& edges)
+// Write the edges of parent starting at row and return the next row.
+{
+    visit_buffered_edges(new_edges, parent, [&](const BirthData& b) {
+        edges.left[row] = b.left;
+        edges.right[row] = b.right;
+        edges.parent[row] = parent;
+        edges.child[row] = b.child;
+        ++row;
+    });
+    return row;
+}
+
+StitchPlan
+plan_stitch(const std::vector<tsk_id_t>& alive_at_last_simplification,
+            const ParentEdgeIndex& index, double max_time, edge_buffer_ptr& new_edges,
+            const table_collection_ptr& tables)
+{
+    StitchPlan plan;
+    sort_buffered_parents(*new_edges);
+    const auto& parents = new_edges->parents;
+    for (auto p = parents.rbegin(); p < parents.rend(); ++p)
+        {
+            if (tables->nodes.time[*p] >= max_time)
+                {
+                    break;
+                }
+            plan.new_parents.push_back(*p);
+        }
+    auto existing_edges = find_pre_existing_edges(tables, alive_at_last_simplification,
+                                                  index, new_edges);
+    plan.insertion_points = find_insertion_points(tables, existing_edges);
+    // Every other parent with births is one of the alive parents,
+    // so we only need to count the births of those.
+    plan.num_new_parent_edges = new_edges->num_births;
+    for (const auto& ex : existing_edges)
+        {
+            plan.alive_parents.push_back(ex.parent);
+            plan.num_new_parent_edges -= num_buffered_edges(new_edges, ex.parent);
+        }
+    return plan;
+}
+
+namespace
+{
+    struct StitchSegment
+    // Part of the output of stitch_together_edges_in_parallel:
+    // either the births of parent, or the existing edges in
+    // rows [start, stop) if parent is TSK_NULL.
+    {
+        tsk_id_t parent;
+        std::size_t start, stop;
+        // First output row
+        std::size_t offset;
+    };
+
+    std::size_t
+    write_births(const edge_buffer_ptr& new_edges, tsk_id_t parent, std::size_t row,
+                 temp_edges& edges)
+    // Write the births of parent starting at row and return the next row.
+    {
+        visit_buffered_edges(new_edges, parent, [&](const BirthData& b) {
+            edges.left[row] = b.left;
+            edges.right[row] = b.right;
+            edges.parent[row] = parent;
+            edges.child[row] = b.child;
+            ++row;
+        });
+        return row;
+    }
+}
+
+void
+stitch_together_edges_in_parallel(
+    const std::vector<tsk_id_t>& alive_at_last_simplification,
+    const ParentEdgeIndex& index, double max_time, edge_buffer_ptr& new_edges,
+    temp_edges& edge_liftover, tbb::task_arena& arena, SimulationStats* stats,
+    table_collection_ptr& tables)
+// Gives the same edge table as stitch_together_edges.  Given the
+// plan, the output is a concatenation of independent segments:
+// the births of each parent and runs of existing edges.  A prefix
+// sum over the segment sizes gives where each segment goes, and
+// then the segments are copied into edge_liftover in parallel.
+//
+// Most segments are births of parents born since the last
+// simplification, so their sizes are counted in parallel and
+// they are written in blocks of consecutive parents.
+{
+    StitchPlan plan;
+    {
+        PhaseTimer timer(stats, phase::stitch_find);
+        plan = plan_stitch(alive_at_last_simplification, index, max_time, new_edges,
+                           tables);
+    }
+    PhaseTimer timer(stats, phase::stitch_handle);
+    const auto& edges = tables->edges;
+    const auto& new_parents = plan.new_parents;
+    std::vector<std::size_t> new_parent_offsets(new_parents.size() + 1, 0);
+    arena.execute([&]() {
+        tbb::parallel_for(std::size_t{0}, new_parents.size(), [&](std::size_t i) {
+            new_parent_offsets[i + 1] = num_buffered_edges(new_edges, new_parents[i]);
+        });
+    });
+    std::partial_sum(begin(new_parent_offsets), end(new_parent_offsets),
+                     begin(new_parent_offsets));
+    if (new_parent_offsets.back() != plan.num_new_parent_edges)
+        {
+            throw std::runtime_error("stitching in parallel went wrong");
+        }
+
+    std::vector<StitchSegment> segments;
+    std::size_t num_rows = new_parent_offsets.back();
+    auto add_segment = [&](tsk_id_t parent, std::size_t start, std::size_t stop) {
+        segments.push_back({parent, start, stop, num_rows});
+        num_rows += stop - start;
+    };
+    std::size_t row = 0;
+    for (std::size_t i = 0; i < plan.alive_parents.size(); ++i)
+        {
+            for (; row < plan.insertion_points[i]; row += STITCH_PIECE_ROWS)
+                {
+                    add_segment(
+                        TSK_NULL, row,
+                        std::min(plan.insertion_points[i], row + STITCH_PIECE_ROWS));
+                }
+            row = plan.insertion_points[i];
+            auto p = plan.alive_parents[i];
+            add_segment(p, 0, num_buffered_edges(new_edges, p));
+        }
+    for (; row < edges.num_rows; row += STITCH_PIECE_ROWS)
+        {
+            add_segment(TSK_NULL, row,
+                        std::min<std::size_t>(edges.num_rows, row + STITCH_PIECE_ROWS));
+        }
+
+    edge_liftover.left.resize(num_rows);
+    edge_liftover.right.resize(num_rows);
+    edge_liftover.parent.resize(num_rows);
+    edge_liftover.child.resize(num_rows);
+    arena.execute([&]() {
+        tbb::parallel_for(tbb::blocked_range<std::size_t>(0, new_parents.size()),
+                          [&](const tbb::blocked_range<std::size_t>& range) {
+                              auto out = new_parent_offsets[range.begin()];
+                              for (auto i = range.begin(); i < range.end(); ++i)
+                                  {
+                                      out = write_births(new_edges, new_parents[i], out,
+                                                         edge_liftover);
+                                  }
+                          });
+        tbb::parallel_for(std::size_t{0}, segments.size(), [&](std::size_t k) {
+            const auto& s = segments[k];
+            if (s.parent != TSK_NULL)
+                {
+                    write_births(new_edges, s.parent, s.offset, edge_liftover);
+                    return;
+                }
+            std::copy(edges.left + s.start, edges.left + s.stop,
+                      begin(edge_liftover.left) + s.offset);
+            std::copy(edges.right + s.start, edges.right + s.stop,
+                      begin(edge_liftover.right) + s.offset);
+            std::copy(edges.parent + s.start, edges.parent + s.stop,
+                      begin(edge_liftover.parent) + s.offset);
+            std::copy(edges.child + s.start, edges.child + s.stop,
+                      begin(edge_liftover.child) + s.offset);
+        });
+    });
+    handle_tskit_return_code(tsk_edge_table_set_columns(
+        &tables->edges, edge_liftover.size(), edge_liftover.left.data(),
+        edge_liftover.right.data(), edge_liftover.parent.data(),
+        edge_liftover.child.data(), nullptr, 0));
+    edge_liftover.clear();
+    reset_edge_buffer(tables->nodes.num_rows, new_edges);
+}
+
+void
+stitch_together_edges_in_place(
+    const std::vector<tsk_id_t>& alive_at_last_simplification,
+    const ParentEdgeIndex& index, double max_time, edge_buffer_ptr& new_edges,
+    SimulationStats* stats, table_collection_ptr& tables)
+// Gives the same edge table as stitch_together_edges, but writes the
+// output directly into the edge table's columns rather than copying
+// everything through a temp_edges.
+// We size the output exactly, grow the columns once, and then fill
+// from the back, so that existing edges are only ever moved towards
+// the end of the table and are never overwritten before they are moved.
+{
+    auto& edges = tables->edges;
+    const std::size_t num_existing = edges.num_rows;
+    StitchPlan plan;
+    {
+        PhaseTimer timer(stats, phase::stitch_find);
+        plan = plan_stitch(alive_at_last_simplification, index, max_time, new_edges,
+                           tables);
+    }
+    PhaseTimer timer(stats, phase::stitch_handle);
+    std::size_t num_rows = num_existing + plan.num_new_parent_edges;
+    for (auto p : plan.alive_parents)
+        {
+            num_rows += num_buffered_edges(new_edges, p);
+        }
+
+    reserve_edge_table_rows(&edges, num_rows);
+    std::size_t write = num_rows, read = num_existing;
+    for (std::size_t i = plan.alive_parents.size(); i-- > 0;)
+        {
+            auto n = read - plan.insertion_points[i];
+            write -= n;
+            move_edge_rows(edges, plan.insertion_points[i], write, n);
+            read = plan.insertion_points[i];
+            write -= num_buffered_edges(new_edges, plan.alive_parents[i]);
+            write_buffered_edges(new_edges, plan.alive_parents[i], write, edges);
+        }
+    write -= read;
+    move_edge_rows(edges, 0, write, read);
+    if (write != plan.num_new_parent_edges)
+        {
+            throw std::runtime_error("stitching in place went wrong");
+        }
+    std::size_t row = 0;
+    for (auto p : plan.new_parents)
+        {
+            row = write_buffered_edges(new_edges, p, row, edges);
+        }
+    std::memset(edges.metadata_offset, 0, (num_rows + 1) * sizeof(tsk_size_t));
+    edges.num_rows = num_rows;
+    reset_edge_buffer(tables->nodes.num_rows, new_edges);
 }
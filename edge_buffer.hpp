@@ -1,32 +1,262 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <tskit.h>
+#include <tbb/task_arena.h>
 #include "tskit_tools.hpp"
+#include "stats.hpp"
 
-using EDGE_BUFFER_INDEX_TYPE = std::int64_t;
+using EDGE_BUFFER_INDEX_TYPE = std::int32_t;
 static const EDGE_BUFFER_INDEX_TYPE NULL_EDGE_BUFFER_INDEX = -1;
+// Chunks of size class s hold 1 << s births, for
+// s < EDGE_BUFFER_NUM_SIZE_CLASSES.
+static const std::size_t EDGE_BUFFER_NUM_SIZE_CLASSES = 6;
+// The low bits of a chunk ID are its size class, and the
+// others are its index among the chunks of that class.
+static const int EDGE_BUFFER_SIZE_CLASS_BITS = 3;
+static_assert(EDGE_BUFFER_NUM_SIZE_CLASSES <= (1 << EDGE_BUFFER_SIZE_CLASS_BITS),
+              "size classes must fit in a chunk ID");
+static_assert((1 << (EDGE_BUFFER_NUM_SIZE_CLASSES - 1)) <= 255,
+              "chunk fill must fit in a std::uint8_t");
+// Number of grid steps spanning the genome for --compact_buffer.
+static const double COMPACT_POSITION_STEPS = 2147483648.; // 2^31
+
+template <typename T> struct default_init_allocator : public std::allocator<T>
+// Growing a vector with this allocator leaves new elements
+// default-initialized, so trivial types are not zeroed.
+{
+    template <typename U> struct rebind
+    {
+        using other = default_init_allocator<U>;
+    };
+
+    using std::allocator<T>::allocator;
+
+    template <typename U>
+    void
+    construct(U* p) noexcept(std::is_nothrow_default_constructible<U>::value)
+    {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void
+    construct(U* p, Args&&... args)
+    {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
 
 struct BirthData
 {
     double left, right;
     tsk_id_t child;
-    EDGE_BUFFER_INDEX_TYPE next;
+    BirthData() = default;
     BirthData(double l, double r, tsk_id_t c);
 };
 
+// With --compact_buffer, each birth is stored as one to three
+// units.  The first unit holds child - parent in its low
+// COMPACT_CHILD_BITS bits, and two flags that say whether the
+// next units hold left and right, which are positions on a grid
+// of COMPACT_POSITION_STEPS steps spanning the genome.  Without
+// a flag, left is 0 or right is the end of the genome.  Without
+// recombination, every birth is therefore a single unit.
+using CompactUnit = std::uint32_t;
+static const int COMPACT_CHILD_BITS = 30;
+static const CompactUnit COMPACT_CHILD_MASK
+    = (CompactUnit{1} << COMPACT_CHILD_BITS) - 1;
+static const CompactUnit COMPACT_HAS_LEFT = CompactUnit{1} << COMPACT_CHILD_BITS;
+static const CompactUnit COMPACT_HAS_RIGHT = CompactUnit{1} << (COMPACT_CHILD_BITS + 1);
+
+inline std::size_t
+compact_birth_units(CompactUnit first)
+// The number of units of the birth that starts with first
+{
+    return 1 + ((first & COMPACT_HAS_LEFT) != 0) + ((first & COMPACT_HAS_RIGHT) != 0);
+}
+
+class CompactBirthDecoder
+// Turns the units of one parent's births, in order, back into births.
+{
+  private:
+    tsk_id_t parent;
+    double scale;
+    CompactUnit first;
+    std::uint32_t left, right;
+    std::size_t remaining;
+
+  public:
+    CompactBirthDecoder(tsk_id_t parent_, double scale_)
+        : parent{parent_}, scale{scale_}, first{0}, left{0}, right{0}, remaining{0}
+    {
+    }
+
+    bool
+    next(CompactUnit u, BirthData& birth)
+    // Returns true if u is the last unit of a birth, which
+    // is then stored in birth.
+    {
+        if (remaining == 0)
+            {
+                first = u;
+                left = 0;
+                right = static_cast<std::uint32_t>(COMPACT_POSITION_STEPS);
+                remaining = compact_birth_units(u) - 1;
+            }
+        else if (remaining == 2 || (first & COMPACT_HAS_RIGHT) == 0)
+            {
+                left = u;
+                --remaining;
+            }
+        else
+            {
+                right = u;
+                --remaining;
+            }
+        if (remaining > 0)
+            {
+                return false;
+            }
+        birth = BirthData(left * scale, right * scale,
+                          parent + static_cast<tsk_id_t>(first & COMPACT_CHILD_MASK));
+        return true;
+    }
+};
+
+template <typename T> using birth_arena = std::vector<T, default_init_allocator<T>>;
+
+template <typename T>
+using per_size_class = std::array<T, EDGE_BUFFER_NUM_SIZE_CLASSES>;
+
 struct EdgeBuffer
+// The births of each parent are stored in chunks taken from
+// one arena per size class.  Chunk k of size class s owns
+// births[s][k << s, (k + 1) << s).  A parent's chunks form a
+// circular list through next, and we keep the tail of each
+// list, whose next is the head.  Appending a birth is O(1),
+// and we need only one index per node.
+//
+// Most parents have one or two births per interval, so a
+// parent's first two chunks hold one birth each, and each
+// later chunk is twice the size of the one before, up to the
+// largest size class.  At most half of a parent's slots are
+// therefore empty.
+//
+// The parents with births are also listed in parents, so that
+// resetting the buffer and visiting its parents take time
+// proportional to the number of parents with births, rather
+// than to the number of nodes.  This matters when most nodes
+// are not parents during an interval, as with overlapping
+// generations.
+//
+// If position_scale > 0, births are stored as CompactUnits in
+// compact_units, and position_scale is the length of one grid
+// step.  A chunk then holds units rather than births, and a
+// birth can span two chunks.  Otherwise, births are stored in
+// births.
 {
-    std::vector<EDGE_BUFFER_INDEX_TYPE> first;
-    std::vector<BirthData> births;
+    // Tail chunk for each parent node
+    std::vector<EDGE_BUFFER_INDEX_TYPE> last;
+    // The nodes whose last is not NULL_EDGE_BUFFER_INDEX.  The
+    // first num_sorted_parents are in increasing order, and the
+    // rest are in the order of their first birth.
+    std::vector<tsk_id_t> parents;
+    std::size_t num_sorted_parents;
+    // For each chunk of each size class: the next chunk for
+    // the same parent and the number of slots used.
+    per_size_class<std::vector<EDGE_BUFFER_INDEX_TYPE>> next;
+    per_size_class<std::vector<std::uint8_t>> fill;
+    per_size_class<birth_arena<BirthData>> births;
+    per_size_class<birth_arena<CompactUnit>> compact_units;
+    double position_scale;
+    // Chunks emptied by prune_edge_buffer, which are
+    // reused before the arena grows.
+    per_size_class<std::vector<EDGE_BUFFER_INDEX_TYPE>> free_chunks;
+    // Number of births stored
+    std::size_t num_births;
 
     EdgeBuffer(std::size_t num_nodes);
+    // Store births compactly, for a genome of length sequence_length
+    EdgeBuffer(std::size_t num_nodes, double sequence_length);
 };
 
+inline std::size_t
+chunk_size_class(EDGE_BUFFER_INDEX_TYPE chunk)
+{
+    return static_cast<std::size_t>(chunk) & ((1 << EDGE_BUFFER_SIZE_CLASS_BITS) - 1);
+}
+
+inline std::size_t
+chunk_capacity(EDGE_BUFFER_INDEX_TYPE chunk)
+{
+    return std::size_t{1} << chunk_size_class(chunk);
+}
+
+inline std::size_t
+chunk_start(EDGE_BUFFER_INDEX_TYPE chunk)
+// Where the births of chunk start in the arena of its size class
+{
+    return (static_cast<std::size_t>(chunk) >> EDGE_BUFFER_SIZE_CLASS_BITS)
+           << chunk_size_class(chunk);
+}
+
+inline EDGE_BUFFER_INDEX_TYPE&
+chunk_next(EdgeBuffer& buffer, EDGE_BUFFER_INDEX_TYPE chunk)
+{
+    return buffer.next[chunk_size_class(chunk)]
+                      [static_cast<std::size_t>(chunk) >> EDGE_BUFFER_SIZE_CLASS_BITS];
+}
+
+inline std::uint8_t&
+chunk_fill(EdgeBuffer& buffer, EDGE_BUFFER_INDEX_TYPE chunk)
+{
+    return buffer.fill[chunk_size_class(chunk)]
+                      [static_cast<std::size_t>(chunk) >> EDGE_BUFFER_SIZE_CLASS_BITS];
+}
+
+inline std::size_t
+chunk_size(EdgeBuffer& buffer, std::size_t parent, EDGE_BUFFER_INDEX_TYPE chunk)
+// The number of slots used in a chunk of parent.  Only the tail
+// can have empty slots, and chunks of one slot are never empty,
+// so this reads fill only for a tail chunk with more than one slot.
+{
+    if (chunk_size_class(chunk) == 0 || chunk != buffer.last[parent])
+        {
+            return chunk_capacity(chunk);
+        }
+    return chunk_fill(buffer, chunk);
+}
+
+inline EDGE_BUFFER_INDEX_TYPE
+first_chunk(EdgeBuffer& buffer, std::size_t parent)
+{
+    const auto tail = buffer.last[parent];
+    return tail == NULL_EDGE_BUFFER_INDEX ? NULL_EDGE_BUFFER_INDEX
+                                          : chunk_next(buffer, tail);
+}
+
+inline EDGE_BUFFER_INDEX_TYPE
+following_chunk(EdgeBuffer& buffer, std::size_t parent, EDGE_BUFFER_INDEX_TYPE chunk)
+// The chunk after chunk in the list of parent, or
+// NULL_EDGE_BUFFER_INDEX at the tail.
+{
+    return chunk == buffer.last[parent] ? NULL_EDGE_BUFFER_INDEX
+                                        : chunk_next(buffer, chunk);
+}
+
 using edge_buffer_ptr = std::unique_ptr<EdgeBuffer>;
 
+edge_buffer_ptr make_edge_buffer_ptr(std::size_t num_nodes, bool compact,
+                                     double sequence_length);
+
 struct ExistingEdges
 {
     tsk_id_t parent;
@@ -34,6 +264,34 @@ struct ExistingEdges
     ExistingEdges(tsk_id_t p, std::size_t start_, std::size_t stop_);
 };
 
+struct ParentEdgeIndex
+// The rows [start[i], stop[i]) of the edge table where node i
+// is a parent, for the nodes alive at the last simplification.
+// Rows are std::numeric_limits<std::size_t>::max() if i has no edges.
+// When buffering, the edge table does not change between
+// simplifications, so this stays valid until the next one.
+{
+    std::vector<std::size_t> start, stop;
+};
+
+struct StitchPlan
+// How buffered edges fit together with the edge table to
+// make a sorted edge table.  The output has three kinds
+// of segments:
+// 1. births to parents born since the last simplification,
+//    which come first, youngest parent first.
+// 2. runs of existing edges, which keep their order.
+// 3. births to parents alive at the last simplification,
+//    inserted between runs of existing edges:  the births
+//    of alive_parents[i] go right before edge table row
+//    insertion_points[i].
+{
+    std::vector<tsk_id_t> new_parents;
+    std::size_t num_new_parent_edges;
+    std::vector<tsk_id_t> alive_parents;
+    std::vector<std::size_t> insertion_points;
+};
+
 struct temp_edges
 // Used for calls to tsk_edge_table_set_columns
 // Within tskit, we'd just use an edge table.
@@ -80,15 +338,99 @@ struct temp_edges
     }
 };
 
-EDGE_BUFFER_INDEX_TYPE get_buffer_end(const edge_buffer_ptr& new_edges, std::size_t i);
+double compact_position(double x, double sequence_length);
+
+template <typename F>
+inline void
+visit_compact_units(EdgeBuffer& buffer, std::size_t parent, F f)
+// Apply f to each CompactUnit of parent, in order.
+{
+    for (auto c = first_chunk(buffer, parent); c != NULL_EDGE_BUFFER_INDEX;
+         c = following_chunk(buffer, parent, c))
+        {
+            auto b = begin(buffer.compact_units[chunk_size_class(c)]) + chunk_start(c);
+            auto e = b + chunk_size(buffer, parent, c);
+            for (; b < e; ++b)
+                {
+                    f(*b);
+                }
+        }
+}
+
+template <typename F>
+inline void
+visit_buffered_edges(const edge_buffer_ptr& new_edges, std::size_t parent, F f)
+// Apply f to each BirthData of parent, in the order they were buffered.
+// Compact births are decoded first.
+{
+    if (new_edges->position_scale > 0.)
+        {
+            CompactBirthDecoder decoder(static_cast<tsk_id_t>(parent),
+                                        new_edges->position_scale);
+            BirthData birth;
+            visit_compact_units(*new_edges, parent, [&](CompactUnit u) {
+                if (decoder.next(u, birth))
+                    {
+                        f(birth);
+                    }
+            });
+            return;
+        }
+    for (auto c = first_chunk(*new_edges, parent); c != NULL_EDGE_BUFFER_INDEX;
+         c = following_chunk(*new_edges, parent, c))
+        {
+            auto b = begin(new_edges->births[chunk_size_class(c)]) + chunk_start(c);
+            auto e = b + chunk_size(*new_edges, parent, c);
+            for (; b < e; ++b)
+                {
+                    f(*b);
+                }
+        }
+}
 
 EDGE_BUFFER_INDEX_TYPE buffer_new_edge(tsk_id_t parent, double left, double right,
                                        tsk_id_t child, edge_buffer_ptr& new_edges);
 
-EDGE_BUFFER_INDEX_TYPE buffer_new_edge_at(EDGE_BUFFER_INDEX_TYPE loc, double left,
-                                          double right, tsk_id_t child,
-                                          edge_buffer_ptr& new_edges);
+void reset_edge_buffer(std::size_t num_nodes, edge_buffer_ptr& new_edges);
+
+std::size_t num_buffered_edges(const edge_buffer_ptr& new_edges);
+
+std::size_t edge_buffer_bytes(const edge_buffer_ptr& new_edges);
+
+std::size_t edge_buffer_bytes_in_use(const edge_buffer_ptr& new_edges);
+
+std::size_t temp_edges_bytes(const temp_edges& edges);
+
+std::size_t prune_edge_buffer(const std::vector<tsk_id_t>& alive, std::size_t num_nodes,
+                              std::vector<std::uint8_t>& is_live,
+                              edge_buffer_ptr& new_edges);
+
+void merge_edge_buffers(std::vector<edge_buffer_ptr>& shards,
+                        edge_buffer_ptr& new_edges);
+
+void remap_edge_buffer(const std::vector<tsk_id_t>& node_map, std::size_t num_nodes,
+                       edge_buffer_ptr& new_edges);
+
+void index_parent_edges(const table_collection_ptr& tables,
+                        const std::vector<tsk_id_t>& alive_at_last_simplification,
+                        ParentEdgeIndex& index);
 
 void stitch_together_edges(const std::vector<tsk_id_t>& alive_at_last_simplification,
-                           double max_time, edge_buffer_ptr& new_edges,
-                           temp_edges& edge_liftover, table_collection_ptr& tables);
+                           const ParentEdgeIndex& index, double max_time,
+                           edge_buffer_ptr& new_edges, temp_edges& edge_liftover,
+                           SimulationStats* stats, table_collection_ptr& tables);
+
+void stitch_together_edges_in_parallel(
+    const std::vector<tsk_id_t>& alive_at_last_simplification,
+    const ParentEdgeIndex& index, double max_time, edge_buffer_ptr& new_edges,
+    temp_edges& edge_liftover, tbb::task_arena& arena, SimulationStats* stats,
+    table_collection_ptr& tables);
+
+StitchPlan plan_stitch(const std::vector<tsk_id_t>& alive_at_last_simplification,
+                       const ParentEdgeIndex& index, double max_time,
+                       edge_buffer_ptr& new_edges, const table_collection_ptr& tables);
+
+void stitch_together_edges_in_place(
+    const std::vector<tsk_id_t>& alive_at_last_simplification,
+    const ParentEdgeIndex& index, double max_time, edge_buffer_ptr& new_edges,
+    SimulationStats* stats, table_collection_ptr& tables);
@@ -1,11 +1,18 @@
+#include <algorithm>
 #include <cmath>
 #include <stdexcept>
 #include "options.hpp"
 
 command_line_options::command_line_options()
     : N{1000}, psurvival{0.}, nsteps{1000},
-      simplification_interval{100}, rho{0.}, treefile{"treefile.trees"},
-      buffer_new_edges{false}, cppsort{false}, parallel_sort{false}, seed{42}
+      simplification_interval{100}, adaptive_simplification{false},
+      mem_budget{0.}, rho{0.}, treefile{"treefile.trees"},
+      buffer_new_edges{false}, stitch_in_place{false}, native_simplify{false},
+      async_simplify{false}, simplify_windows{1}, prune_interval{0},
+      compact_buffer{false}, cppsort{false}, parallel_sort{false},
+      sort_method{"comparison"}, incremental_sort{false}, nthreads{1},
+      numa_node{-1}, counter_rng{false}, seed{42}, stats_json{}, verify{false},
+      checkpoint{}, checkpoint_interval{1}, resume{}
 {
 }
 
@@ -23,13 +30,148 @@ validate_cli(const command_line_options& options)
             throw std::invalid_argument("psurvival must be 0.0 <= p < 1.0");
         }
 
+    if (options.simplification_interval == 0)
+        {
+            throw std::invalid_argument("simplify must be > 0 or auto");
+        }
+
+    if (options.mem_budget < 0. || std::isfinite(options.mem_budget) == false)
+        {
+            throw std::invalid_argument("mem_budget must be >= 0.0");
+        }
+
     if (options.rho < 0.0 || std::isfinite(options.rho) == false)
         {
             throw std::invalid_argument("rho must be >= 0.0");
         }
 
+    if (options.stitch_in_place && options.buffer_new_edges == false)
+        {
+            throw std::invalid_argument("stitch_in_place requires buffer");
+        }
+
+    if (options.native_simplify && options.buffer_new_edges == false)
+        {
+            throw std::invalid_argument("native_simplify requires buffer");
+        }
+
+    if (options.native_simplify && options.stitch_in_place)
+        {
+            throw std::invalid_argument(
+                "native_simplify and stitch_in_place are mutually exclusive");
+        }
+
+    if (options.sort_method != "comparison" && options.sort_method != "radix")
+        {
+            throw std::invalid_argument("sort must be comparison or radix");
+        }
+
+    if (options.async_simplify && options.buffer_new_edges == false)
+        {
+            throw std::invalid_argument("async_simplify requires buffer");
+        }
+
+    if (options.async_simplify
+        && (options.adaptive_simplification || options.mem_budget > 0.))
+        {
+            throw std::invalid_argument(
+                "async_simplify cannot be used with simplify auto or mem_budget");
+        }
+
+    if (options.simplify_windows == 0)
+        {
+            throw std::invalid_argument("simplify_windows must be > 0");
+        }
+
+    if (options.simplify_windows > 1 && options.native_simplify)
+        {
+            throw std::invalid_argument(
+                "simplify_windows cannot be used with native_simplify");
+        }
+
+    if (options.simplify_windows > 1 && options.async_simplify)
+        {
+            throw std::invalid_argument(
+                "simplify_windows cannot be used with async_simplify");
+        }
+
+    if (options.prune_interval > 0 && options.buffer_new_edges == false)
+        {
+            throw std::invalid_argument("prune_interval requires buffer");
+        }
+
+    if (options.compact_buffer && options.buffer_new_edges == false)
+        {
+            throw std::invalid_argument("compact_buffer requires buffer");
+        }
+
+    if (options.verify && options.buffer_new_edges == false)
+        {
+            throw std::invalid_argument("verify requires buffer");
+        }
+
+    if (options.incremental_sort && options.buffer_new_edges)
+        {
+            throw std::invalid_argument("incremental_sort cannot be used with buffer");
+        }
+
+    if (options.nthreads == 0)
+        {
+            throw std::invalid_argument("threads must be > 0");
+        }
+
+    if (options.numa_node < -1)
+        {
+            throw std::invalid_argument("numa_node must be >= -1");
+        }
+
+    if (options.checkpoint_interval == 0)
+        {
+            throw std::invalid_argument("checkpoint_interval must be > 0");
+        }
+
+    if (options.checkpoint.empty() == false && options.async_simplify)
+        {
+            throw std::invalid_argument("checkpoint cannot be used with async_simplify");
+        }
+
     if (options.treefile.empty())
         {
             throw std::invalid_argument("treefile must not be an empty string");
         }
 }
+
+sweep_options::sweep_options()
+    : N{1000}, psurvival{0.}, rho{0.}, nsteps{1000}, simplification_intervals{100},
+      methods{"sort"}, threads{1}, replicates{1}, seed{42}, jobs{0}, output{}
+{
+}
+
+void
+validate_sweep(const sweep_options& options)
+// Values for each run are checked by validate_cli.
+{
+    if (options.N.empty() || options.psurvival.empty() || options.rho.empty()
+        || options.nsteps.empty() || options.simplification_intervals.empty()
+        || options.methods.empty() || options.threads.empty())
+        {
+            throw std::invalid_argument("each sweep parameter needs at least one value");
+        }
+
+    const std::vector<std::string> methods{"sort", "radix", "buffer", "buffer_in_place",
+                                           "buffer_native"};
+    for (const auto& m : options.methods)
+        {
+            if (std::find(begin(methods), end(methods), m) == end(methods))
+                {
+                    throw std::invalid_argument(
+                        "method must be sort, radix, buffer, buffer_in_place, or "
+                        "buffer_native");
+                }
+        }
+
+    if (options.replicates == 0)
+        {
+            throw std::invalid_argument("replicates must be > 0");
+        }
+}
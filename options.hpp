@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 struct command_line_options
 {
@@ -8,14 +9,62 @@ struct command_line_options
     double psurvival;
     unsigned nsteps;
     unsigned simplification_interval;
+    // --simplify auto
+    bool adaptive_simplification;
+    // Megabytes, or 0 for no limit
+    double mem_budget;
     double rho;
     std::string treefile;
     bool buffer_new_edges;
+    bool stitch_in_place;
+    bool native_simplify;
+    bool async_simplify;
+    unsigned simplify_windows;
+    unsigned prune_interval;
+    bool compact_buffer;
     bool cppsort;
     bool parallel_sort;
+    std::string sort_method;
+    bool incremental_sort;
+    unsigned nthreads;
+    // -1 for any
+    int numa_node;
+    bool counter_rng;
     unsigned seed;
+    std::string stats_json;
+    bool verify;
+    // Empty for no checkpoints
+    std::string checkpoint;
+    unsigned checkpoint_interval;
+    // Empty to start from the first generation
+    std::string resume;
 
     command_line_options();
 };
 
 void validate_cli(const command_line_options &);
+
+struct sweep_options
+// For wfbuffered sweep.  Every combination of the values below
+// is run replicates times, replicate r with seed + r.
+{
+    std::vector<unsigned> N;
+    std::vector<double> psurvival;
+    std::vector<double> rho;
+    std::vector<unsigned> nsteps;
+    std::vector<unsigned> simplification_intervals;
+    // sort, radix, buffer, buffer_in_place, or buffer_native
+    std::vector<std::string> methods;
+    // Values of --threads
+    std::vector<unsigned> threads;
+    unsigned replicates;
+    unsigned seed;
+    // Number of runs at a time, or 0 for one per core
+    unsigned jobs;
+    // Empty for standard output
+    std::string output;
+
+    sweep_options();
+};
+
+void validate_sweep(const sweep_options &);
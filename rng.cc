@@ -1,3 +1,4 @@
+#include <cmath>
 #include "rng.hpp"
 
 GSLrng
@@ -7,3 +8,146 @@ make_rng(unsigned seed)
     gsl_rng_set(rng.get(), seed);
     return rng;
 }
+
+namespace
+{
+    inline std::array<std::uint32_t, 4>
+    philox4x32_10(std::array<std::uint32_t, 4> ctr, std::array<std::uint32_t, 2> key)
+    {
+        const std::uint64_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+        const std::uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+        for (int round = 0; round < 10; ++round)
+            {
+                std::uint64_t p0 = M0 * ctr[0];
+                std::uint64_t p1 = M1 * ctr[2];
+                ctr = {static_cast<std::uint32_t>(p1 >> 32) ^ ctr[1] ^ key[0],
+                       static_cast<std::uint32_t>(p1),
+                       static_cast<std::uint32_t>(p0 >> 32) ^ ctr[3] ^ key[1],
+                       static_cast<std::uint32_t>(p0)};
+                key[0] += W0;
+                key[1] += W1;
+            }
+        return ctr;
+    }
+
+    inline double
+    to_uniform(std::uint32_t a, std::uint32_t b)
+    // 53 random bits -> [0, 1)
+    {
+        return ((a >> 5) * 67108864.0 + (b >> 6)) * (1.0 / 9007199254740992.0);
+    }
+
+    // Second key word.  Arbitrary, but fixed.
+    const std::uint32_t KEY1 = 0x5EED0F5A;
+}
+
+CounterRNG::CounterRNG(unsigned s) : seed{s}
+{
+}
+
+CounterStream::CounterStream(const CounterRNG& rng, std::uint32_t generation,
+                             std::uint32_t index, rng_purpose purpose)
+    : key{rng.seed, KEY1},
+      counter{0, index, generation, static_cast<std::uint32_t>(purpose)}, block{},
+      next{4}
+{
+}
+
+double
+CounterStream::uniform()
+{
+    if (next == 4)
+        {
+            block = philox4x32_10(counter, key);
+            ++counter[0];
+            next = 0;
+        }
+    auto rv = to_uniform(block[next], block[next + 1]);
+    next += 2;
+    return rv;
+}
+
+double
+CounterStream::flat(double a, double b)
+{
+    return a + (b - a) * uniform();
+}
+
+unsigned
+CounterStream::poisson(double mean)
+// Inversion by sequential search for small means,
+// and the PTRS method of Hormann (1993) otherwise.
+{
+    if (mean <= 0.)
+        {
+            return 0;
+        }
+    if (mean < 10.)
+        {
+            double p = std::exp(-mean), cdf = p, u = uniform();
+            unsigned k = 0;
+            while (u > cdf && p > 0.)
+                {
+                    ++k;
+                    p *= mean / k;
+                    cdf += p;
+                }
+            return k;
+        }
+    const double slam = std::sqrt(mean), loglam = std::log(mean);
+    const double b = 0.931 + 2.53 * slam;
+    const double a = -0.059 + 0.02483 * b;
+    const double invalpha = 1.1239 + 1.1328 / (b - 3.4);
+    const double vr = 0.9277 - 3.6224 / (b - 2.);
+    while (true)
+        {
+            double U = uniform() - 0.5;
+            double V = uniform();
+            double us = 0.5 - std::fabs(U);
+            double k = std::floor((2. * a / us + b) * U + mean + 0.43);
+            if (us >= 0.07 && V <= vr)
+                {
+                    return static_cast<unsigned>(k);
+                }
+            if (k < 0. || (us < 0.013 && V > us))
+                {
+                    continue;
+                }
+            if (std::log(V) + std::log(invalpha) - std::log(a / (us * us) + b)
+                <= -mean + k * loglam - std::lgamma(k + 1.))
+                {
+                    return static_cast<unsigned>(k);
+                }
+        }
+}
+
+void
+uniform_batch(const CounterRNG& rng, std::uint32_t generation, rng_purpose purpose,
+              std::uint32_t first_index, std::size_t n, double* out)
+// out[i] is the first uniform() of the stream for index first_index + i.
+{
+    const std::array<std::uint32_t, 2> key{rng.seed, KEY1};
+    for (std::size_t i = 0; i < n; ++i)
+        {
+            auto block = philox4x32_10(
+                {0, static_cast<std::uint32_t>(first_index + i), generation,
+                 static_cast<std::uint32_t>(purpose)},
+                key);
+            out[i] = to_uniform(block[0], block[1]);
+        }
+}
+
+void
+uniform_pair_batch(const CounterRNG& rng, std::uint32_t generation, rng_purpose purpose,
+                   const std::uint32_t* indexes, std::size_t n, double* first,
+                   double* second)
+{
+    const std::array<std::uint32_t, 2> key{rng.seed, KEY1};
+    for (std::size_t i = 0; i < n; ++i)
+        {
+            auto block = philox4x32_10(
+                {0, indexes[i], generation, static_cast<std::uint32_t>(purpose)}, key);
+            first[i] = to_uniform(block[0], block[1]);
+            second[i] = to_uniform(block[2], block[3]);
+        }
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <functional>
 #include <gsl/gsl_rng.h>
@@ -8,3 +11,52 @@ using GSLrng = std::unique_ptr<gsl_rng, std::function<void(gsl_rng *)>>;
 
 
 GSLrng make_rng(unsigned seed);
+
+// What a stream of counter-based random numbers is used for.
+// Part of the counter, so that each purpose gets independent
+// draws for the same generation and index.
+enum class rng_purpose : std::uint32_t
+{
+    survival,
+    parents,
+    meiosis,
+    breakpoints
+};
+
+struct CounterRNG
+// Counter-based random number generation (Philox4x32-10,
+// Salmon et al. 2011).  The draws for a given
+// (generation, index, purpose) are a pure function
+// of the seed, so they can be made in any order and
+// on any thread.
+{
+    std::uint32_t seed;
+    explicit CounterRNG(unsigned s);
+};
+
+class CounterStream
+// The stream of random numbers for one (generation, index, purpose).
+{
+  private:
+    std::array<std::uint32_t, 2> key;
+    std::array<std::uint32_t, 4> counter, block;
+    unsigned next;
+
+  public:
+    CounterStream(const CounterRNG &rng, std::uint32_t generation,
+                  std::uint32_t index, rng_purpose purpose);
+    // Uniform on [0, 1)
+    double uniform();
+    // Uniform on [a, b)
+    double flat(double a, double b);
+    unsigned poisson(double mean);
+};
+
+void uniform_batch(const CounterRNG &rng, std::uint32_t generation, rng_purpose purpose,
+                   std::uint32_t first_index, std::size_t n, double *out);
+
+// first[i] and second[i] are the first two uniform()s of the
+// stream for index indexes[i], which come from one Philox block.
+void uniform_pair_batch(const CounterRNG &rng, std::uint32_t generation,
+                        rng_purpose purpose, const std::uint32_t *indexes,
+                        std::size_t n, double *first, double *second);
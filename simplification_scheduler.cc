@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "simplification_scheduler.hpp"
+
+namespace
+{
+    // How much the threshold changes after each simplification
+    constexpr double STEP_FACTOR = 1.25;
+    // Where to cap the threshold, relative to the number
+    // of edges when the memory budget was reached.
+    constexpr double MEMORY_MARGIN = 0.9;
+    // Where to put the memory trigger, relative to the size
+    // of simplified tables that do not fit in the budget.
+    constexpr double MEMORY_HEADROOM = 1.25;
+}
+
+SimplificationScheduler::SimplificationScheduler(unsigned initial_steps_,
+                                                 std::uint64_t memory_budget_bytes)
+    : initial_steps{initial_steps_}, memory_budget{memory_budget_bytes},
+      memory_trigger{memory_budget_bytes}, threshold{0},
+      min_threshold{1}, max_threshold{std::numeric_limits<std::size_t>::max()},
+      factor{STEP_FACTOR}, last_cost{-1.}, hit_memory_budget{false}
+{
+    if (initial_steps == 0)
+        {
+            throw std::invalid_argument("initial_steps must be > 0");
+        }
+}
+
+bool
+SimplificationScheduler::should_simplify(std::size_t new_edges, unsigned steps,
+                                         std::uint64_t bytes)
+{
+    if (threshold == 0 && steps > 0)
+        {
+            min_threshold = std::max<std::size_t>(1, new_edges / steps);
+            threshold = min_threshold * initial_steps;
+        }
+    hit_memory_budget = memory_trigger > 0 && bytes >= memory_trigger;
+    return hit_memory_budget || (threshold > 0 && new_edges >= threshold);
+}
+
+void
+SimplificationScheduler::simplified(double seconds, unsigned steps,
+                                    std::size_t new_edges)
+{
+    if (steps == 0 || threshold == 0)
+        {
+            return;
+        }
+    if (hit_memory_budget)
+        {
+            max_threshold = std::max<std::size_t>(
+                min_threshold, static_cast<std::size_t>(MEMORY_MARGIN * new_edges));
+        }
+    const double cost = seconds / steps;
+    if (last_cost >= 0. && cost > last_cost)
+        {
+            factor = 1. / factor;
+        }
+    last_cost = cost;
+    double next = std::max(1., factor * static_cast<double>(threshold));
+    if (next >= static_cast<double>(max_threshold))
+        {
+            threshold = max_threshold;
+        }
+    else
+        {
+            threshold = std::max(min_threshold, static_cast<std::size_t>(next));
+        }
+    hit_memory_budget = false;
+}
+
+bool
+SimplificationScheduler::simplified_bytes(std::uint64_t bytes)
+{
+    if (memory_budget == 0)
+        {
+            return false;
+        }
+    memory_trigger = std::max(
+        memory_budget, static_cast<std::uint64_t>(MEMORY_HEADROOM * bytes));
+    return bytes >= memory_budget;
+}
+
+std::size_t
+SimplificationScheduler::current_threshold() const
+{
+    return threshold;
+}
+
+std::uint64_t
+SimplificationScheduler::current_memory_trigger() const
+{
+    return memory_trigger;
+}
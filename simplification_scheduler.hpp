@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class SimplificationScheduler
+// Decides when to simplify for --simplify auto.
+//
+// We simplify once the number of edges added since the last
+// simplification reaches a threshold, or once the memory in
+// use reaches the budget, whichever comes first.
+//
+// The first threshold is the number of edges from the first
+// time step times initial_steps, and the smallest threshold
+// is the number of edges from one time step.
+//
+// The threshold is tuned by hill climbing on the time per
+// step of each interval, counting both the simulation and
+// the simplification that ends it.  After each simplification,
+// the threshold moves by a constant factor.  If the cost per
+// step went up since the last simplification, the direction
+// of the moves is reversed.  When the memory budget forces a
+// simplification, the threshold is capped below the number
+// of edges that we had at that point.
+//
+// The simplified tables alone may not fit in the budget.
+// Simplifying again would not help, so we then trigger on a
+// margin above their size instead of on the budget, until
+// they fit again.  The fixed interval of --simplify uses the
+// same memory trigger.
+{
+  private:
+    unsigned initial_steps;
+    std::uint64_t memory_budget, memory_trigger;
+    std::size_t threshold, min_threshold, max_threshold;
+    double factor, last_cost;
+    bool hit_memory_budget;
+
+  public:
+    // A budget of 0 means no memory limit.
+    SimplificationScheduler(unsigned initial_steps_, std::uint64_t memory_budget_bytes);
+
+    // new_edges and steps are counted since the last simplification,
+    // and bytes is the memory in use now.
+    bool should_simplify(std::size_t new_edges, unsigned steps, std::uint64_t bytes);
+    // seconds is the time since the end of the last simplification.
+    void simplified(double seconds, unsigned steps, std::size_t new_edges);
+    // bytes is the memory in use right after a simplification.
+    // Returns true if that is over the budget.
+    bool simplified_bytes(std::uint64_t bytes);
+    std::size_t current_threshold() const;
+    // The memory in use at which we simplify, or 0 for no limit.
+    std::uint64_t current_memory_trigger() const;
+};
@@ -2,299 +2,751 @@
 #include <cstring>
 #include <sstream>
 #include <algorithm>
+#include <numeric>
 #include <tuple>
 #include <limits>
 #include <memory>
+#include <future>
+#include <chrono>
 #include <vector>
+#include <cstdint>
 #include <gsl/gsl_randist.h>
+#include <tbb/info.h>
+#include <tbb/task_arena.h>
+#include <tbb/parallel_for.h>
+#include "options.hpp"
 #include "rng.hpp"
 #include "tskit_tools.hpp"
 #include "edge_buffer.hpp"
+#include "buffered_simplifier.hpp"
 #include "sort_tables.hpp"
+#include "stats.hpp"
+#include "simplification_scheduler.hpp"
+#include "windowed_simplifier.hpp"
+#include "checkpoint.hpp"
 
 namespace
 {
-    struct Parent
+    struct Births
+    // The births of a generation, as arrays.  Birth j replaces
+    // individual index[j], and its parents are individuals
+    // parent0[j] and parent1[j].  The nodes of the parents are
+    // gathered into p0node0[j], p0node1[j], p1node0[j], and
+    // p1node1[j], so that generating births reads them in order.
     {
-        std::size_t index;
-        tsk_id_t node0, node1;
-        Parent(std::size_t i, tsk_id_t n0, tsk_id_t n1) : index(i), node0(n0), node1(n1)
+        std::vector<std::uint32_t> index, parent0, parent1;
+        std::vector<tsk_id_t> p0node0, p0node1, p1node0, p1node1;
+
+        std::size_t
+        size() const
         {
+            return index.size();
+        }
+
+        void
+        clear()
+        {
+            index.clear();
+            parent0.clear();
+            parent1.clear();
+        }
+    };
+
+    struct Meioses
+    // The random outcomes of the two meioses of each birth in a
+    // generation.  Meiosis 2*i (2*i + 1) is from the first (second)
+    // parent of birth i.  If swap[m], the parental nodes of meiosis m
+    // are swapped, and its breakpoints are
+    // breakpoints[offsets[m], offsets[m + 1]).  Without recombination,
+    // breakpoints and offsets are empty.
+    {
+        std::vector<std::uint8_t> swap;
+        std::vector<double> breakpoints;
+        std::vector<std::size_t> offsets;
+    };
+
+    struct EdgeColumns
+    // Writes edges straight into the columns of an edge
+    // table, which must have reserved space for them.
+    {
+        tsk_edge_table_t* edges;
+    };
+
+    struct ParallelBirths
+    // Threads and per-thread edge storage for generating births.
+    // Only used when nthreads > 1.  arena is the task arena of the
+    // simulation, which has nthreads threads.  For edge buffering,
+    // each thread fills its own EdgeBuffer, and they are merged when simplifying.
+    // Otherwise, the edges from each thread are appended to the
+    // edge table after each generation.
+    {
+        std::size_t nthreads;
+        tbb::task_arena& arena;
+        std::vector<edge_buffer_ptr> buffers;
+        std::vector<temp_edges> edges;
+
+        ParallelBirths(std::size_t n, tbb::task_arena& arena_, bool buffer_new_edges,
+                       bool compact_buffer, std::size_t num_nodes,
+                       double sequence_length)
+            : nthreads{n}, arena(arena_), buffers{}, edges{}
+        {
+            if (nthreads > 1)
+                {
+                    if (buffer_new_edges)
+                        {
+                            for (std::size_t i = 0; i < nthreads; ++i)
+                                {
+                                    buffers.emplace_back(make_edge_buffer_ptr(
+                                        num_nodes, compact_buffer, sequence_length));
+                                }
+                        }
+                    else
+                        {
+                            edges.resize(nthreads);
+                        }
+                }
+        }
+    };
+
+    class SimplificationRecord
+    // Table sizes and time for one simplification.
+    // Does nothing if stats is nullptr.
+    {
+      private:
+        using clock = std::chrono::steady_clock;
+        SimulationStats* stats;
+        SimplificationStats record;
+        clock::time_point start;
+
+      public:
+        template <typename MemoryUsageFunction>
+        SimplificationRecord(SimulationStats* s, unsigned step, std::size_t threshold,
+                             const table_collection_ptr& tables,
+                             const edge_buffer_ptr& new_edges,
+                             const MemoryUsageFunction& memory_usage)
+            : stats{s}, record{}, start{}
+        {
+            if (stats != nullptr)
+                {
+                    record.step = step;
+                    record.threshold = threshold;
+                    record.bytes = memory_usage();
+                    stats->record_memory(record.bytes);
+                    record.nodes_before = tables->nodes.num_rows;
+                    record.edges_before = tables->edges.num_rows;
+                    record.buffered_edges
+                        = new_edges == nullptr ? 0 : num_buffered_edges(new_edges);
+                    start = clock::now();
+                }
+        }
+
+        void
+        finish(const table_collection_ptr& tables)
+        {
+            if (stats != nullptr)
+                {
+                    std::chrono::duration<double> dt = clock::now() - start;
+                    record.seconds = dt.count();
+                    record.nodes_after = tables->nodes.num_rows;
+                    record.edges_after = tables->edges.num_rows;
+                    stats->simplifications.push_back(record);
+                }
         }
     };
 
-    struct Birth
+    struct AsyncSimplification
+    // A simplification running on another thread while the
+    // main thread generates the births of the next interval.
+    // The worker owns the tables and the buffered edges as they
+    // were when it started.  The main thread records nodes in a
+    // copy of the node table, so new node IDs continue from
+    // first_new_node, and buffers edges in a fresh EdgeBuffer.
+    // When the worker is done, the node IDs used by the main
+    // thread are remapped to the simplified tables.
     {
-        std::size_t index;
-        tsk_id_t p0node0, p0node1, p1node0, p1node1;
-        Birth(std::size_t i, const Parent& p0, const Parent& p1)
-            : index(i), p0node0(p0.node0), p0node1(p0.node1), p1node0(p1.node0),
-              p1node1(p1.node1)
+        table_collection_ptr tables;
+        edge_buffer_ptr new_edges;
+        tsk_id_t first_new_node;
+        std::future<void> done;
+
+        AsyncSimplification() : tables{}, new_edges{}, first_new_node{0}, done{}
         {
         }
     };
 }
 
-static void
-handle_tskit_return_code(int code)
+static tbb::task_arena::constraints
+arena_constraints(unsigned nthreads, int numa_node)
+// For --threads and --numa_node.  TBB only knows about NUMA
+// nodes if it can load its hwloc binding library (tbbbind).
 {
-    if (code != 0)
+    if (numa_node >= 0)
         {
-            std::ostringstream o;
-            o << tsk_strerror(code);
-            throw std::runtime_error(o.str());
+            auto nodes = tbb::info::numa_nodes();
+            if (std::find(begin(nodes), end(nodes), numa_node) == end(nodes))
+                {
+                    std::ostringstream o;
+                    o << "NUMA node " << numa_node << " is not available";
+                    throw std::invalid_argument(o.str());
+                }
         }
+    return tbb::task_arena::constraints(numa_node, static_cast<int>(nthreads));
 }
 
 static tsk_id_t
-record_node(double t, table_collection_ptr& tables)
+record_nodes(std::size_t n, double t, table_collection_ptr& tables)
+// Add n nodes with time t, and return the ID of the first.
+// The columns are written directly, rather than a row at a time.
 {
-    return tsk_node_table_add_row(&tables->nodes,
-                                  0,        // flag
-                                  t,        // time
-                                  TSK_NULL, // population
-                                  TSK_NULL, // individual
-                                  nullptr,  // metadata
-                                  0         // metadata length
-    );
+    auto& nodes = tables->nodes;
+    const auto first = nodes.num_rows;
+    const auto last = first + n;
+    reserve_node_table_rows(&nodes, grown_capacity(nodes.max_rows, last));
+    std::fill(nodes.flags + first, nodes.flags + last, 0);
+    std::fill(nodes.time + first, nodes.time + last, t);
+    std::fill(nodes.population + first, nodes.population + last, TSK_NULL);
+    std::fill(nodes.individual + first, nodes.individual + last, TSK_NULL);
+    std::fill(nodes.metadata_offset + first + 1, nodes.metadata_offset + last + 1,
+              nodes.metadata_length);
+    nodes.num_rows = last;
+    return static_cast<tsk_id_t>(first);
 }
 
 static void
-deaths_and_parents(const GSLrng& rng, const std::vector<Parent>& parents,
-                   double psurvival, std::vector<Birth>& births)
+gather_parent_nodes(const std::vector<tsk_id_t>& parent_nodes, Births& births)
 {
+    const std::size_t n = births.size();
+    births.p0node0.resize(n);
+    births.p0node1.resize(n);
+    births.p1node0.resize(n);
+    births.p1node1.resize(n);
+    for (std::size_t j = 0; j < n; ++j)
+        {
+            const std::size_t p0 = 2 * std::size_t{births.parent0[j]};
+            const std::size_t p1 = 2 * std::size_t{births.parent1[j]};
+            births.p0node0[j] = parent_nodes[p0];
+            births.p0node1[j] = parent_nodes[p0 + 1];
+            births.p1node0[j] = parent_nodes[p1];
+            births.p1node1[j] = parent_nodes[p1 + 1];
+        }
+}
+
+static void
+deaths_and_parents(const GSLrng& rng, const std::vector<tsk_id_t>& parent_nodes,
+                   double psurvival, Births& births)
+// The nodes of individual i are parent_nodes[2*i] and parent_nodes[2*i + 1].
+// The draws for each individual come from one stream, so they
+// are made in turn, but only the indexes are stored in the loop.
+{
+    const std::size_t N = parent_nodes.size() / 2;
     births.clear();
-    for (std::size_t i = 0; i < parents.size(); ++i)
+    for (std::size_t i = 0; i < N; ++i)
         {
             if (gsl_rng_uniform(rng.get()) > psurvival)
                 {
-                    std::size_t parent0 = gsl_ran_flat(rng.get(), 0, parents.size());
-                    std::size_t parent1 = gsl_ran_flat(rng.get(), 0, parents.size());
-                    births.emplace_back(i, parents[parent0], parents[parent1]);
+                    births.index.push_back(static_cast<std::uint32_t>(i));
+                    births.parent0.push_back(
+                        static_cast<std::uint32_t>(gsl_ran_flat(rng.get(), 0, N)));
+                    births.parent1.push_back(
+                        static_cast<std::uint32_t>(gsl_ran_flat(rng.get(), 0, N)));
                 }
         }
+    gather_parent_nodes(parent_nodes, births);
 }
 
-void
-recombination_breakpoints(const GSLrng& rng, double littler, double maxlen,
-                          std::vector<double>& breakpoints)
+static void
+deaths_and_parents(const CounterRNG& rng, std::uint32_t generation,
+                   const std::vector<tsk_id_t>& parent_nodes, double psurvival,
+                   std::vector<double>& uniforms, Births& births)
+// Same as above, but each individual has its own random
+// number streams for survival and the choice of parents,
+// so we draw survival for everyone, and then both parents
+// of everyone who dies, each in one batch.
 {
-    breakpoints.clear();
-    auto nxovers = gsl_ran_poisson(rng.get(), littler);
-    for (decltype(nxovers) i = 0; i < nxovers; ++i)
+    const std::size_t N = parent_nodes.size() / 2;
+    births.clear();
+    uniforms.resize(N);
+    uniform_batch(rng, generation, rng_purpose::survival, 0, N, uniforms.data());
+    for (std::size_t i = 0; i < N; ++i)
         {
-            breakpoints.push_back(gsl_ran_flat(rng.get(), 0., maxlen));
+            if (uniforms[i] > psurvival)
+                {
+                    births.index.push_back(static_cast<std::uint32_t>(i));
+                }
+        }
+    const std::size_t n = births.size();
+    uniforms.resize(2 * n);
+    uniform_pair_batch(rng, generation, rng_purpose::parents, births.index.data(), n,
+                       uniforms.data(), uniforms.data() + n);
+    births.parent0.resize(n);
+    births.parent1.resize(n);
+    const double size = static_cast<double>(N);
+    for (std::size_t j = 0; j < n; ++j)
+        {
+            births.parent0[j] = static_cast<std::uint32_t>(size * uniforms[j]);
+            births.parent1[j] = static_cast<std::uint32_t>(size * uniforms[n + j]);
         }
-    std::sort(begin(breakpoints), end(breakpoints));
+    gather_parent_nodes(parent_nodes, births);
+}
 
-    // Remove all values that do not exist an odd number of times
-    auto itr = std::adjacent_find(begin(breakpoints), end(breakpoints));
-    if (itr != end(breakpoints))
+static double*
+remove_even_multiplicity(double* first, double* last)
+// Given sorted breakpoints in [first, last), keep one copy
+// of each value present an odd number of times, and
+// remove all copies of the others.  Returns the new end.
+{
+    auto out = first;
+    while (first < last)
         {
-            std::vector<double> temp;
-            auto start = begin(breakpoints);
-            while (itr < end(breakpoints))
+            auto not_equal = std::find_if(first, last,
+                                          [first](const double d) { return d != *first; });
+            if (std::distance(first, not_equal) % 2 != 0)
                 {
-                    auto not_equal
-                        = std::find_if(itr, breakpoints.end(),
-                                       [itr](const double d) { return d != *itr; });
-                    int even = (std::distance(itr, not_equal) % 2 == 0.0);
-                    temp.insert(temp.end(), start, itr + 1 - even);
-                    start = not_equal;
-                    itr = std::adjacent_find(start, std::end(breakpoints));
+                    *out++ = *first;
                 }
-            temp.insert(end(temp), start, breakpoints.end());
-            breakpoints.swap(temp);
+            first = not_equal;
         }
+    return out;
 }
 
-void
-recombine_and_record_edges(const GSLrng& rng, double littler,
-                           std::vector<double>& breakpoints, tsk_id_t parental_node0,
-                           tsk_id_t parental_node1, tsk_id_t child,
-                           table_collection_ptr& tables)
-// NOTE: this is an improvement on what I do in fwdpp?
+static double*
+quantize_breakpoints(double* first, double* last, double maxlen)
+// Round sorted breakpoints down to the grid of --compact_buffer,
+// so that the edge buffer stores them exactly.  Breakpoints that
+// become equal are treated like any other repeated breakpoint.
 {
-    recombination_breakpoints(rng, littler, tables->sequence_length, breakpoints);
-    double left = 0.;
-    std::size_t breakpoint = 1;
-    auto pnode0 = parental_node0;
-    auto pnode1 = parental_node1;
-    for (; breakpoint < breakpoints.size(); ++breakpoint)
+    for (auto b = first; b < last; ++b)
         {
-            auto rv
-                = tsk_edge_table_add_row(&tables->edges, left, breakpoints[breakpoint],
-                                         pnode0, child, nullptr, 0);
-            std::swap(pnode0, pnode1);
-            left = breakpoints[breakpoint];
+            *b = compact_position(*b, maxlen);
         }
-    auto rv = tsk_edge_table_add_row(&tables->edges, left, tables->sequence_length,
-                                     pnode0, child, nullptr, 0);
+    return remove_even_multiplicity(first, last);
 }
 
-void
-recombine_and_buffer_edges(const GSLrng& rng, double littler,
-                           std::vector<double>& breakpoints, tsk_id_t parental_node0,
-                           tsk_id_t parental_node1, tsk_id_t child, double maxlen,
-                           edge_buffer_ptr& new_edges)
+static void
+sort_breakpoints(double* first, double* last)
+// Most meioses have few breakpoints, so we use sorting
+// networks for up to four of them, and std::sort otherwise.
 {
-    recombination_breakpoints(rng, littler, maxlen, breakpoints);
-    double left = 0.;
-    std::size_t breakpoint = 1;
-    auto pnode0 = parental_node0;
-    auto pnode1 = parental_node1;
-    EDGE_BUFFER_INDEX_TYPE end = NULL_EDGE_BUFFER_INDEX,
-                           other_end = NULL_EDGE_BUFFER_INDEX;
-    if (pnode0 < new_edges->first.size())
+    auto compare_swap = [first](std::size_t i, std::size_t j) {
+        const double a = first[i], b = first[j];
+        first[i] = std::min(a, b);
+        first[j] = std::max(a, b);
+    };
+    switch (last - first)
         {
-            end = get_buffer_end(new_edges, pnode0);
+        case 0:
+        case 1:
+            return;
+        case 2:
+            compare_swap(0, 1);
+            return;
+        case 3:
+            compare_swap(0, 1);
+            compare_swap(1, 2);
+            compare_swap(0, 1);
+            return;
+        case 4:
+            compare_swap(0, 1);
+            compare_swap(2, 3);
+            compare_swap(0, 2);
+            compare_swap(1, 3);
+            compare_swap(1, 2);
+            return;
+        default:
+            std::sort(first, last);
         }
-    if (pnode1 < new_edges->first.size())
+}
+
+static void
+append_breakpoints(const GSLrng& rng, double littler, double maxlen, bool quantize,
+                   std::vector<double>& breakpoints)
+// Draw the breakpoints of one meiosis and append them to breakpoints.
+// They are sorted, and we keep one copy of each value present an odd
+// number of times.  The draws are the same as always: the number of
+// crossovers, then their positions.
+{
+    const auto nxovers = gsl_ran_poisson(rng.get(), littler);
+    const auto offset = breakpoints.size();
+    breakpoints.resize(offset + nxovers);
+    auto first = breakpoints.data() + offset;
+    auto last = first + nxovers;
+    for (auto b = first; b < last; ++b)
         {
-            other_end = get_buffer_end(new_edges, pnode1);
+            *b = gsl_ran_flat(rng.get(), 0., maxlen);
         }
+    sort_breakpoints(first, last);
+    last = quantize ? quantize_breakpoints(first, last, maxlen)
+                    : remove_even_multiplicity(first, last);
+    breakpoints.resize(std::distance(breakpoints.data(), last));
+}
 
-    for (; breakpoint < breakpoints.size(); ++breakpoint)
+template <bool recombination>
+static void
+draw_meioses(const GSLrng& rng, std::size_t nbirths, double littler, double maxlen,
+             bool quantize, Meioses& meioses)
+// Make all of the random draws for the meioses of a generation.
+// The draws happen in the same order as when each birth was
+// generated in turn, so the results do not depend on how the
+// edges are generated afterwards.
+{
+    meioses.swap.clear();
+    meioses.breakpoints.clear();
+    meioses.offsets.clear();
+    if constexpr (recombination == false)
         {
-            if (end == -1)
+            for (std::size_t i = 0; i < nbirths; ++i)
                 {
-                    end = buffer_new_edge(pnode0, left, breakpoints[breakpoint], child,
-                                          new_edges);
+                    meioses.swap.push_back(gsl_rng_uniform(rng.get()) < 0.5);
+                    meioses.swap.push_back(gsl_rng_uniform(rng.get()) < 0.5);
+                    // Keep the random number stream the same as with
+                    // append_breakpoints, which always draws the
+                    // number of crossovers.
+                    gsl_ran_poisson(rng.get(), 0.);
+                    gsl_ran_poisson(rng.get(), 0.);
                 }
-            else
+            return;
+        }
+    meioses.offsets.push_back(0);
+    for (std::size_t i = 0; i < nbirths; ++i)
+        {
+            meioses.swap.push_back(gsl_rng_uniform(rng.get()) < 0.5);
+            meioses.swap.push_back(gsl_rng_uniform(rng.get()) < 0.5);
+            for (int parent = 0; parent < 2; ++parent)
                 {
-                    end = buffer_new_edge_at(end, left, breakpoints[breakpoint], child,
-                                             new_edges);
+                    append_breakpoints(rng, littler, maxlen, quantize,
+                                       meioses.breakpoints);
+                    meioses.offsets.push_back(meioses.breakpoints.size());
                 }
-            std::swap(pnode0, pnode1);
-            std::swap(end, other_end);
-            left = breakpoints[breakpoint];
         }
-    if (end == -1)
+}
+
+template <bool recombination>
+static void
+draw_meioses(const CounterRNG& rng, std::uint32_t generation,
+             const Births& births, double littler, double maxlen,
+             bool quantize, ParallelBirths& parallel, Meioses& meioses)
+// Same as above, but the draws for meiosis m of birth i come
+// from streams indexed by 2*births.index[i] + m, so the
+// meioses can be drawn in parallel.
+{
+    const std::size_t nmeioses = 2 * births.size();
+    meioses.swap.resize(nmeioses);
+    auto stream_index = [&births](std::size_t m) {
+        return static_cast<std::uint32_t>(2 * births.index[m / 2] + m % 2);
+    };
+    if constexpr (recombination == false)
         {
-            end = buffer_new_edge(pnode0, left, maxlen, child, new_edges);
+            // The number of crossovers is the next draw from each
+            // stream, so we can skip it.
+            meioses.breakpoints.clear();
+            meioses.offsets.clear();
+            parallel.arena.execute([&]() {
+                tbb::parallel_for(std::size_t{0}, nmeioses, [&](std::size_t m) {
+                    CounterStream stream(rng, generation, stream_index(m),
+                                         rng_purpose::meiosis);
+                    meioses.swap[m] = stream.uniform() < 0.5;
+                });
+            });
+            return;
         }
-    else
+    meioses.offsets.resize(nmeioses + 1);
+    meioses.offsets[0] = 0;
+    // First pass: parental swaps and the number of crossovers
+    parallel.arena.execute([&]() {
+        tbb::parallel_for(std::size_t{0}, nmeioses, [&](std::size_t m) {
+            CounterStream stream(rng, generation, stream_index(m), rng_purpose::meiosis);
+            meioses.swap[m] = stream.uniform() < 0.5;
+            meioses.offsets[m + 1] = stream.poisson(littler);
+        });
+    });
+    std::partial_sum(begin(meioses.offsets), end(meioses.offsets),
+                     begin(meioses.offsets));
+    meioses.breakpoints.resize(meioses.offsets.back());
+    // Second pass: crossover positions
+    std::vector<std::size_t> nkept(nmeioses);
+    parallel.arena.execute([&]() {
+        tbb::parallel_for(std::size_t{0}, nmeioses, [&](std::size_t m) {
+            CounterStream stream(rng, generation, stream_index(m),
+                                 rng_purpose::breakpoints);
+            auto first = meioses.breakpoints.data() + meioses.offsets[m];
+            auto last = meioses.breakpoints.data() + meioses.offsets[m + 1];
+            for (auto b = first; b < last; ++b)
+                {
+                    *b = stream.flat(0., maxlen);
+                }
+            sort_breakpoints(first, last);
+            auto kept = quantize ? quantize_breakpoints(first, last, maxlen)
+                                 : remove_even_multiplicity(first, last);
+            nkept[m] = std::distance(first, kept);
+        });
+    });
+    // Close any gaps left by removing breakpoints
+    std::size_t out = 0;
+    for (std::size_t m = 0; m < nmeioses; ++m)
         {
-            end = buffer_new_edge_at(end, left, maxlen, child, new_edges);
+            auto first = begin(meioses.breakpoints) + meioses.offsets[m];
+            if (out != meioses.offsets[m])
+                {
+                    std::copy(first, first + nkept[m], begin(meioses.breakpoints) + out);
+                }
+            meioses.offsets[m] = out;
+            out += nkept[m];
         }
+    meioses.offsets[nmeioses] = out;
+    meioses.breakpoints.resize(out);
+}
+
+static void
+add_edge(double left, double right, tsk_id_t parent, tsk_id_t child,
+         EdgeColumns& columns)
+{
+    auto& edges = *columns.edges;
+    const auto i = edges.num_rows;
+    edges.left[i] = left;
+    edges.right[i] = right;
+    edges.parent[i] = parent;
+    edges.child[i] = child;
+    edges.metadata_offset[i + 1] = edges.metadata_length;
+    edges.num_rows = i + 1;
+}
+
+static void
+add_edge(double left, double right, tsk_id_t parent, tsk_id_t child,
+         temp_edges& edges)
+{
+    edges.add_edge(left, right, parent, child);
+}
 
-    //buffer_new_edge(pnode0, left, maxlen, child, new_edges);
+static void
+add_edge(double left, double right, tsk_id_t parent, tsk_id_t child,
+         edge_buffer_ptr& new_edges)
+{
+    buffer_new_edge(parent, left, right, child, new_edges);
+}
+
+template <bool recombination, typename EdgeSink>
+static void
+recombine_and_add_edges(const Meioses& meioses, std::size_t meiosis,
+                        tsk_id_t parental_node0, tsk_id_t parental_node1,
+                        tsk_id_t child, double maxlen, EdgeSink& edges)
+// NOTE: this is an improvement on what I do in fwdpp?
+{
+    if constexpr (recombination == false)
+        {
+            add_edge(0., maxlen, parental_node0, child, edges);
+            return;
+        }
+    const double* breakpoints = meioses.breakpoints.data() + meioses.offsets[meiosis];
+    std::size_t nbreakpoints = meioses.offsets[meiosis + 1] - meioses.offsets[meiosis];
+    double left = 0.;
+    std::size_t breakpoint = 1;
+    auto pnode0 = parental_node0;
+    auto pnode1 = parental_node1;
+    for (; breakpoint < nbreakpoints; ++breakpoint)
+        {
+            add_edge(left, breakpoints[breakpoint], pnode0, child, edges);
+            std::swap(pnode0, pnode1);
+            left = breakpoints[breakpoint];
+        }
+    add_edge(left, maxlen, pnode0, child, edges);
 }
 
+template <bool recombination, typename EdgeSink>
 static void
-generate_births(const GSLrng& rng, const std::vector<Birth>& births, double littler,
-                std::vector<double>& breakpoints, double birth_time,
-                bool buffer_new_edges, edge_buffer_ptr& new_edges,
-                std::vector<Parent>& parents, table_collection_ptr& tables)
+generate_births_block(const Births& births, std::size_t first, std::size_t last,
+                      tsk_id_t first_new_node, const Meioses& meioses,
+                      const table_collection_ptr& tables,
+                      std::vector<tsk_id_t>& parent_nodes, EdgeSink& edges)
+// Generate the edges of births [first, last).  The nodes for
+// birth i are first_new_node + 2*i and first_new_node + 2*i + 1,
+// and must already be in the node table.
 {
-    for (auto& b : births)
+    for (std::size_t i = first; i < last; ++i)
         {
-            auto new_node_0 = record_node(birth_time, tables);
-            auto new_node_1 = record_node(birth_time, tables);
-            auto p0n0 = b.p0node0;
-            auto p0n1 = b.p0node1;
-            if (gsl_rng_uniform(rng.get()) < 0.5)
+            tsk_id_t new_node_0 = first_new_node + 2 * i;
+            tsk_id_t new_node_1 = new_node_0 + 1;
+            auto p0n0 = births.p0node0[i];
+            auto p0n1 = births.p0node1[i];
+            if (meioses.swap[2 * i])
                 {
                     std::swap(p0n0, p0n1);
                 }
-            auto p1n0 = b.p1node0;
-            auto p1n1 = b.p1node1;
-            if (gsl_rng_uniform(rng.get()) < 0.5)
+            auto p1n0 = births.p1node0[i];
+            auto p1n1 = births.p1node1[i];
+            if (meioses.swap[2 * i + 1])
                 {
                     std::swap(p1n0, p1n1);
                 }
+            if (tables->nodes.time[new_node_0] >= tables->nodes.time[p0n0]
+                || tables->nodes.time[new_node_1] >= tables->nodes.time[p1n0])
+                {
+                    throw std::runtime_error("bad parent/child time");
+                }
+            recombine_and_add_edges<recombination>(meioses, 2 * i, p0n0, p0n1,
+                                                   new_node_0, tables->sequence_length,
+                                                   edges);
+            recombine_and_add_edges<recombination>(meioses, 2 * i + 1, p1n0, p1n1,
+                                                   new_node_1, tables->sequence_length,
+                                                   edges);
+            parent_nodes[2 * std::size_t{births.index[i]}] = new_node_0;
+            parent_nodes[2 * std::size_t{births.index[i]} + 1] = new_node_1;
+        }
+}
+
+static void
+append_edges(std::vector<temp_edges>& shards, table_collection_ptr& tables)
+// Append the edges of each thread in turn to the edge table,
+// writing the columns directly, and empty the shards.
+{
+    auto& edges = tables->edges;
+    tsk_size_t num_rows = edges.num_rows;
+    for (auto& shard : shards)
+        {
+            num_rows += shard.size();
+        }
+    reserve_edge_table_rows(&edges, grown_capacity(edges.max_rows, num_rows));
+    for (auto& shard : shards)
+        {
+            const auto first = edges.num_rows;
+            const auto n = shard.size();
+            std::copy(begin(shard.left), end(shard.left), edges.left + first);
+            std::copy(begin(shard.right), end(shard.right), edges.right + first);
+            std::copy(begin(shard.parent), end(shard.parent), edges.parent + first);
+            std::copy(begin(shard.child), end(shard.child), edges.child + first);
+            std::fill(edges.metadata_offset + first + 1,
+                      edges.metadata_offset + first + n + 1, edges.metadata_length);
+            edges.num_rows = first + n;
+            shard.clear();
+        }
+}
+
+template <bool recombination>
+static void
+generate_births(const Births& births, const Meioses& meioses, double birth_time,
+                bool buffer_new_edges, ParallelBirths& parallel,
+                edge_buffer_ptr& new_edges, std::vector<tsk_id_t>& parent_nodes,
+                table_collection_ptr& tables)
+{
+    tsk_id_t first_new_node = record_nodes(2 * births.size(), birth_time, tables);
+    if (parallel.nthreads == 1)
+        {
             if (buffer_new_edges == false)
                 {
-                    recombine_and_record_edges(rng, littler, breakpoints, p0n0, p0n1,
-                                               new_node_0, tables);
-                    recombine_and_record_edges(rng, littler, breakpoints, p1n0, p1n1,
-                                               new_node_1, tables);
+                    // Each meiosis gives one more edge than it has breakpoints
+                    auto& edges = tables->edges;
+                    reserve_edge_table_rows(
+                        &edges, grown_capacity(edges.max_rows,
+                                               edges.num_rows + meioses.breakpoints.size()
+                                                   + 2 * births.size()));
+                    EdgeColumns columns{&edges};
+                    generate_births_block<recombination>(births, 0, births.size(),
+                                                         first_new_node, meioses, tables,
+                                                         parent_nodes, columns);
                 }
             else
                 {
-                    double ptime = tables->nodes.time[p0n0];
-                    double ctime = tables->nodes.time[new_node_0];
-                    if (ctime >= ptime)
-                        {
-                            throw std::runtime_error("bad parent/child time");
-                        }
-                    recombine_and_buffer_edges(rng, littler, breakpoints, p0n0, p0n1,
-                                               new_node_0, tables->sequence_length,
-                                               new_edges);
-                    ptime = tables->nodes.time[p1n0];
-                    ctime = tables->nodes.time[new_node_1];
-                    if (ctime >= ptime)
-                        {
-                            throw std::runtime_error("bad parent/child time");
-                        }
-                    recombine_and_buffer_edges(rng, littler, breakpoints, p1n0, p1n1,
-                                               new_node_1, tables->sequence_length,
-                                               new_edges);
+                    generate_births_block<recombination>(births, 0, births.size(),
+                                                         first_new_node, meioses, tables,
+                                                         parent_nodes, new_edges);
+                }
+            return;
+        }
+
+    // Block k of the births goes to shard k.  Blocks are contiguous
+    // and in birth order, so appending the shards in order gives
+    // the same edges as generating all births on one thread.
+    const std::size_t nshards = parallel.nthreads;
+    parallel.arena.execute([&]() {
+        tbb::parallel_for(std::size_t{0}, nshards, [&](std::size_t k) {
+            auto first = k * births.size() / nshards;
+            auto last = (k + 1) * births.size() / nshards;
+            if (buffer_new_edges == false)
+                {
+                    generate_births_block<recombination>(births, first, last,
+                                                         first_new_node, meioses, tables,
+                                                         parent_nodes,
+                                                         parallel.edges[k]);
+                }
+            else
+                {
+                    generate_births_block<recombination>(births, first, last,
+                                                         first_new_node, meioses, tables,
+                                                         parent_nodes,
+                                                         parallel.buffers[k]);
                 }
-            parents[b.index] = Parent(b.index, new_node_0, new_node_1);
+        });
+    });
+    if (buffer_new_edges == false)
+        {
+            append_edges(parallel.edges, tables);
         }
 }
 
-// NOTE: seems like samples could/should be const?
 static void
-sort_n_simplify(bool cppsort, bool parallel_sort, double last_time_simplified,
-                std::vector<tsk_id_t>& samples, std::vector<tsk_id_t>& node_map,
-                table_collection_ptr& tables)
+simplify_tables(const std::vector<tsk_id_t>& samples, WindowedSimplifier& windowed,
+                std::vector<tsk_id_t>& node_map, table_collection_ptr& tables)
 {
-    //tsk_bookmark_t bookmark;
-    //std::memset(&bookmark, 0, sizeof(bookmark));
-    //tsk_id_t parent_to_sort = TSK_NULL, last_parent = TSK_NULL;
-    //std::size_t last_parent_index = std::numeric_limits<std::size_t>::max();
-    //for (std::size_t i = 0; i < tables->edges.num_rows && parent_to_sort == TSK_NULL;
-    //     ++i)
-    //    {
-    //        if (tables->edges.parent[i] != last_parent)
-    //            {
-    //                last_parent = tables->edges.parent[i];
-    //                last_parent_index = i;
-    //            }
-    //        if (tables->nodes.time[tables->edges.child[i]] < last_time_simplified)
-    //            {
-    //                parent_to_sort = tables->edges.parent[i];
-    //            }
-    //    }
-    //if (parent_to_sort != TSK_NULL)
-    //    {
-    //        bookmark.edges = last_parent_index;
-    //    }
-    //int rv = tsk_table_collection_sort(tables.get(), &bookmark, 0);
-    int rv = -1;
-    if (cppsort == false)
+    if (windowed.num_windows > 1)
         {
-            rv = tsk_table_collection_sort(tables.get(), nullptr, 0);
-            handle_tskit_return_code(rv);
+            simplify_in_windows(samples, windowed, node_map, tables);
+            return;
         }
-    else
-        {
-            sort_tables(tables.get(), parallel_sort);
-        }
-    //if (bookmark.edges > 0)
-    //    {
-    //        std::rotate(tables->edges.left, tables->edges.left + bookmark.edges,
-    //                    tables->edges.left + tables->edges.num_rows);
-    //        std::rotate(tables->edges.right, tables->edges.right + bookmark.edges,
-    //                    tables->edges.right + tables->edges.num_rows);
-    //        std::rotate(tables->edges.parent, tables->edges.parent + bookmark.edges,
-    //                    tables->edges.parent + tables->edges.num_rows);
-    //        std::rotate(tables->edges.child, tables->edges.child + bookmark.edges,
-    //                    tables->edges.child + tables->edges.num_rows);
-    //    }
-    rv = tsk_table_collection_simplify(tables.get(), samples.data(), samples.size(), 0,
-                                       node_map.data());
+    int rv = tsk_table_collection_simplify(tables.get(), samples.data(), samples.size(),
+                                           0, node_map.data());
     handle_tskit_return_code(rv);
 }
 
+// NOTE: seems like samples could/should be const?
+static void
+sort_n_simplify(bool cppsort, bool radix_sort, bool parallel_sort,
+                bool incremental_sort, tsk_size_t& edges_at_last_simplification,
+                std::vector<tsk_id_t>& samples, std::vector<tsk_id_t>& node_map,
+                WindowedSimplifier& windowed, tbb::task_arena& arena,
+                SimulationStats* stats, table_collection_ptr& tables)
+// Parallel sorting uses the threads of arena.
+{
+    int rv = -1;
+    {
+        PhaseTimer timer(stats, phase::sort);
+        arena.execute([&]() {
+            if (incremental_sort == true)
+                {
+                    // The edges output by the last simplification
+                    // are sorted, so we only sort the newer edges.
+                    sort_new_edges_and_merge(tables.get(), edges_at_last_simplification,
+                                             radix_sort, parallel_sort);
+                }
+            else if (radix_sort == true)
+                {
+                    radix_sort_tables(tables.get(), parallel_sort);
+                }
+            else if (cppsort == false)
+                {
+                    rv = tsk_table_collection_sort(tables.get(), nullptr, 0);
+                    handle_tskit_return_code(rv);
+                }
+            else
+                {
+                    sort_tables(tables.get(), parallel_sort);
+                }
+        });
+    }
+    PhaseTimer timer(stats, phase::simplify);
+    simplify_tables(samples, windowed, node_map, tables);
+    edges_at_last_simplification = tables->edges.num_rows;
+}
+
 static void
 flush_buffer_n_simplify(std::vector<tsk_id_t>& alive_at_last_simplification,
+                        const ParentEdgeIndex& parent_edge_index,
                         std::vector<tsk_id_t>& samples, std::vector<tsk_id_t>& node_map,
-                        edge_buffer_ptr& new_edges, temp_edges& edge_liftover,
+                        bool stitch_in_place, bool native_simplify,
+                        BufferedSimplifier& simplifier, WindowedSimplifier& windowed,
+                        tbb::task_arena* stitch_arena, edge_buffer_ptr& new_edges,
+                        temp_edges& edge_liftover, SimulationStats* stats,
                         table_collection_ptr& tables)
+// The births buffered by threads must already be merged into new_edges.
+// If stitch_arena is not nullptr, edges are stitched in parallel on it.
 {
     double max_time = std::numeric_limits<double>::max();
     for (auto a : alive_at_last_simplification)
@@ -302,87 +754,519 @@ flush_buffer_n_simplify(std::vector<tsk_id_t>& alive_at_last_simplification,
             max_time = std::min(max_time, tables->nodes.time[a]);
         }
 
-    stitch_together_edges(alive_at_last_simplification, max_time, new_edges,
-                          edge_liftover, tables);
-    int rv = tsk_table_collection_simplify(tables.get(), samples.data(), samples.size(),
-                                           0, node_map.data());
+    if (native_simplify == true)
+        {
+            simplify_edge_buffer(alive_at_last_simplification, parent_edge_index,
+                                 max_time, samples, new_edges, simplifier, node_map,
+                                 stats, tables);
+            return;
+        }
+    if (stitch_in_place == false && stitch_arena != nullptr)
+        {
+            stitch_together_edges_in_parallel(alive_at_last_simplification,
+                                              parent_edge_index, max_time, new_edges,
+                                              edge_liftover, *stitch_arena, stats,
+                                              tables);
+        }
+    else if (stitch_in_place == false)
+        {
+            stitch_together_edges(alive_at_last_simplification, parent_edge_index,
+                                  max_time, new_edges, edge_liftover, stats, tables);
+        }
+    else
+        {
+            stitch_together_edges_in_place(alive_at_last_simplification,
+                                           parent_edge_index, max_time, new_edges,
+                                           stats, tables);
+        }
+    PhaseTimer timer(stats, phase::simplify);
+    simplify_tables(samples, windowed, node_map, tables);
+}
+
+static void
+merge_thread_buffers(ParallelBirths& parallel, SimulationStats* stats,
+                     edge_buffer_ptr& new_edges)
+{
+    if (parallel.nthreads > 1)
+        {
+            PhaseTimer timer(stats, phase::merge_buffers);
+            merge_edge_buffers(parallel.buffers, new_edges);
+        }
+}
+
+static void
+prune_buffered_births(const std::vector<tsk_id_t>& parent_nodes,
+                      ParallelBirths& parallel, std::vector<std::uint8_t>& is_live,
+                      SimulationStats* stats, edge_buffer_ptr& new_edges,
+                      const table_collection_ptr& tables)
+// Pruning needs to follow descendants across the births of all
+// threads, so we merge the thread buffers first.
+{
+    merge_thread_buffers(parallel, stats, new_edges);
+    PhaseTimer timer(stats, phase::prune);
+    auto removed
+        = prune_edge_buffer(parent_nodes, tables->nodes.num_rows, is_live, new_edges);
+    if (stats != nullptr)
+        {
+            stats->pruned_births += removed;
+        }
+}
+
+static MemoryUsage
+memory_usage(const edge_buffer_ptr& new_edges, const ParallelBirths& parallel,
+             const AsyncSimplification& async, const temp_edges& edge_liftover,
+             const BufferedSimplifier& simplifier, const WindowedSimplifier& windowed,
+             const table_collection_ptr& tables)
+// Must not be called while an async simplification is running.
+{
+    MemoryUsage bytes;
+    auto& edge_buffer = bytes[static_cast<std::size_t>(memory_component::edge_buffer)];
+    edge_buffer = edge_buffer_bytes(new_edges) + edge_buffer_bytes(async.new_edges);
+    for (auto& b : parallel.buffers)
+        {
+            edge_buffer += edge_buffer_bytes(b);
+        }
+    auto& liftover = bytes[static_cast<std::size_t>(memory_component::temp_edges)];
+    liftover = temp_edges_bytes(edge_liftover);
+    for (auto& e : parallel.edges)
+        {
+            liftover += temp_edges_bytes(e);
+        }
+    bytes[static_cast<std::size_t>(memory_component::simplifier)]
+        = buffered_simplifier_bytes(simplifier) + windowed_simplifier_bytes(windowed);
+    bytes[static_cast<std::size_t>(memory_component::node_table)]
+        = node_table_bytes(tables->nodes);
+    bytes[static_cast<std::size_t>(memory_component::edge_table)]
+        = edge_table_bytes(tables->edges);
+    return bytes;
+}
+
+static std::uint64_t
+memory_in_use(const edge_buffer_ptr& new_edges, const ParallelBirths& parallel,
+              const table_collection_ptr& tables)
+// Bytes used by the rows of the node and edge tables, and by
+// the edge buffers.  Unlike memory_usage, this counts sizes
+// rather than capacities, so that it goes down when we simplify.
+// The buffers keep their capacity when they are emptied, and
+// it grows in jumps, so a budget on capacity would be reached
+// right after each simplification.
+{
+    constexpr std::uint64_t node_bytes
+        = sizeof(tsk_flags_t) + sizeof(double) + 2 * sizeof(tsk_id_t);
+    constexpr std::uint64_t edge_bytes = 2 * sizeof(double) + 2 * sizeof(tsk_id_t);
+    std::uint64_t bytes
+        = tables->nodes.num_rows * node_bytes + tables->edges.num_rows * edge_bytes;
+    bytes += edge_buffer_bytes_in_use(new_edges);
+    for (auto& b : parallel.buffers)
+        {
+            bytes += edge_buffer_bytes_in_use(b);
+        }
+    return bytes;
+}
+
+static void
+update_memory_trigger(std::uint64_t bytes, SimplificationScheduler& scheduler,
+                      bool& warned)
+// bytes is the memory in use right after a simplification.
+// If the tables no longer fit in the budget, the scheduler
+// raises its memory trigger, and we warn the first time.
+// validate_cli rejects mem_budget with async_simplify, as the
+// worker owns the simplified tables until it is done, so we
+// could not measure them.
+{
+    if (scheduler.simplified_bytes(bytes) && warned == false)
+        {
+            std::cerr << "warning: the tables use "
+                      << static_cast<double>(bytes) / (1024. * 1024.)
+                      << "MB after simplification, which is more than mem_budget.  "
+                         "Simplifying when memory use is "
+                      << static_cast<double>(scheduler.current_memory_trigger())
+                             / (1024. * 1024.)
+                      << "MB instead.\n";
+            warned = true;
+        }
+}
+
+static std::size_t
+edges_since_last_simplification(bool buffer_new_edges, const edge_buffer_ptr& new_edges,
+                                const ParallelBirths& parallel,
+                                tsk_size_t edges_at_last_simplification,
+                                const table_collection_ptr& tables)
+{
+    if (buffer_new_edges == false)
+        {
+            return tables->edges.num_rows - edges_at_last_simplification;
+        }
+    std::size_t n = num_buffered_edges(new_edges);
+    for (auto& b : parallel.buffers)
+        {
+            n += num_buffered_edges(b);
+        }
+    return n;
+}
+
+static void
+start_async_simplification(std::vector<tsk_id_t>& alive_at_last_simplification,
+                           ParentEdgeIndex& parent_edge_index,
+                           std::vector<tsk_id_t>& samples,
+                           std::vector<tsk_id_t>& node_map,
+                           bool stitch_in_place, bool native_simplify,
+                           BufferedSimplifier& simplifier, WindowedSimplifier& windowed,
+                           edge_buffer_ptr& new_edges, temp_edges& edge_liftover,
+                           AsyncSimplification& async,
+                           SimplificationRecord record, SimulationStats* stats,
+                           table_collection_ptr& tables)
+// Until finish_async_simplification is called, the worker
+// thread owns all of the arguments except for new_edges
+// and tables.
+{
+    const auto& nodes = tables->nodes;
+    auto node_copy = make_table_collection_ptr(tables->sequence_length);
+    int rv = tsk_node_table_set_columns(&node_copy->nodes, nodes.num_rows, nodes.flags,
+                                        nodes.time, nodes.population, nodes.individual,
+                                        nullptr, nullptr);
     handle_tskit_return_code(rv);
+    async.first_new_node = nodes.num_rows;
+    async.tables = std::move(tables);
+    tables = std::move(node_copy);
+
+    // Re-use the buffer from the last simplification
+    if (async.new_edges == nullptr)
+        {
+            async.new_edges = make_edge_buffer_ptr(tables->nodes.num_rows,
+                                                   new_edges->position_scale > 0.,
+                                                   tables->sequence_length);
+        }
+    else
+        {
+            reset_edge_buffer(tables->nodes.num_rows, async.new_edges);
+        }
+    std::swap(async.new_edges, new_edges);
+
+    async.done = std::async(std::launch::async, [&, stitch_in_place, native_simplify,
+                                                 record, stats]() mutable {
+        // The main thread is using the threads of the arena for births,
+        // so we stitch on this one.  validate_cli rejects
+        // --simplify_windows, which would also use the arena.
+        flush_buffer_n_simplify(alive_at_last_simplification, parent_edge_index, samples,
+                                node_map, stitch_in_place, native_simplify, simplifier,
+                                windowed, nullptr, async.new_edges, edge_liftover, stats,
+                                async.tables);
+        record.finish(async.tables);
+        alive_at_last_simplification.clear();
+        for (auto s : samples)
+            {
+                alive_at_last_simplification.push_back(node_map[s]);
+            }
+        index_parent_edges(async.tables, alive_at_last_simplification,
+                           parent_edge_index);
+    });
 }
 
-void
-simulate(const GSLrng& rng, unsigned N, double psurvival, unsigned nsteps,
-         unsigned simplification_interval, double rho, bool buffer_new_edges,
-         bool cppsort, bool parallel_sort, table_collection_ptr& tables)
+static void
+finish_async_simplification(std::vector<tsk_id_t>& node_map, ParallelBirths& parallel,
+                            AsyncSimplification& async,
+                            std::vector<tsk_id_t>& parent_nodes,
+                            edge_buffer_ptr& new_edges, SimulationStats* stats,
+                            table_collection_ptr& tables)
+// Wait for the worker, then move the nodes recorded since it
+// started to the end of the simplified node table.
 {
-    std::vector<Parent> parents;
-    for (unsigned i = 0; i < N; ++i)
+    if (async.done.valid() == false)
         {
-            auto id0 = record_node(nsteps, tables);
-            auto id1 = record_node(nsteps, tables);
-            parents.emplace_back(i, id0, id1);
+            return;
+        }
+    async.done.get();
+    merge_thread_buffers(parallel, stats, new_edges);
+    PhaseTimer timer(stats, phase::remap);
+
+    auto& simplified = async.tables;
+    const tsk_size_t num_new_nodes = tables->nodes.num_rows - async.first_new_node;
+    const tsk_id_t first_output_node = simplified->nodes.num_rows;
+    const auto& nodes = tables->nodes;
+    const auto first = async.first_new_node;
+    int rv = tsk_node_table_append_columns(
+        &simplified->nodes, num_new_nodes, nodes.flags + first, nodes.time + first,
+        nodes.population + first, nodes.individual + first, nullptr, nullptr);
+    handle_tskit_return_code(rv);
+
+    node_map.resize(nodes.num_rows);
+    for (tsk_size_t i = 0; i < num_new_nodes; ++i)
+        {
+            node_map[first + i] = first_output_node + i;
+        }
+    for (auto& u : parent_nodes)
+        {
+            u = node_map[u];
+        }
+    remap_edge_buffer(node_map, simplified->nodes.num_rows, new_edges);
+    tables = std::move(simplified);
+}
+
+static void
+simulate_from(const GSLrng& rng, const command_line_options& options,
+              const CheckpointState* resume, SimulationStats* stats,
+              table_collection_ptr& tables)
+// Starts from the first generation if resume is nullptr, and
+// otherwise continues from resume and the tables.
+{
+    const unsigned N = options.N;
+    const unsigned nsteps = options.nsteps;
+    const unsigned simplification_interval = options.simplification_interval;
+    const auto memory_budget
+        = static_cast<std::uint64_t>(options.mem_budget * 1024. * 1024.);
+    const bool buffer_new_edges = options.buffer_new_edges;
+    const bool cppsort = options.cppsort;
+    const bool radix_sort = options.sort_method == "radix";
+    const bool parallel_sort = options.parallel_sort;
+
+    // The nodes of individual i are parent_nodes[2*i] and parent_nodes[2*i + 1]
+    std::vector<tsk_id_t> parent_nodes(2 * static_cast<std::size_t>(N));
+    unsigned first_step = 1;
+    if (resume == nullptr)
+        {
+            auto first_node = record_nodes(2 * N, nsteps, tables);
+            std::iota(begin(parent_nodes), end(parent_nodes), first_node);
+        }
+    else
+        {
+            if (resume->parent_nodes.size() != parent_nodes.size())
+                {
+                    throw std::invalid_argument("checkpoint is for a different N");
+                }
+            if (resume->nsteps != nsteps)
+                {
+                    throw std::invalid_argument("checkpoint is for a different nsteps");
+                }
+            parent_nodes = resume->parent_nodes;
+            first_step = resume->step + 1;
         }
 
     // The next bits are all for buffering
     std::vector<tsk_id_t> alive_at_last_simplification;
+    ParentEdgeIndex parent_edge_index;
     temp_edges edge_liftover;
+    BufferedSimplifier simplifier;
+    // Every parallel phase runs on this arena, which has
+    // options.nthreads threads.  The --async_simplify worker
+    // is one more thread, outside of the arena.  Under sweep
+    // --jobs, each concurrent run has an arena of its own.
+    tbb::task_arena arena(arena_constraints(options.nthreads, options.numa_node));
+    WindowedSimplifier windowed(options.simplify_windows, tables->sequence_length,
+                                arena);
 
     edge_buffer_ptr new_edges(nullptr);
     if (buffer_new_edges)
         {
-            new_edges.reset(new EdgeBuffer(tables->nodes.num_rows));
-            if (new_edges->first.size() != 2 * N)
+            new_edges = make_edge_buffer_ptr(tables->nodes.num_rows,
+                                             options.compact_buffer,
+                                             tables->sequence_length);
+            if (new_edges->last.size() != tables->nodes.num_rows)
                 {
                     throw std::runtime_error("bad setup of edge_buffer_ptr");
                 }
+            if (resume != nullptr)
+                {
+                    // As after a simplification
+                    alive_at_last_simplification = resume->parent_nodes;
+                    index_parent_edges(tables, alive_at_last_simplification,
+                                       parent_edge_index);
+                }
         }
+    ParallelBirths parallel(options.nthreads, arena, buffer_new_edges,
+                            options.compact_buffer, tables->nodes.num_rows,
+                            tables->sequence_length);
+    // With more than one thread, stitch_together_edges is done in parallel
+    tbb::task_arena* stitch_arena = parallel.nthreads > 1 ? &arena : nullptr;
 
-    std::vector<Birth> births;
+    Births births;
     std::vector<tsk_id_t> samples, node_map;
+    // For --prune_interval
+    std::vector<std::uint8_t> is_live;
     bool simplified = false;
-    double last_time_simplified = nsteps;
-    double littler = rho / (4. * static_cast<double>(N));
-    std::vector<double> breakpoints;
-    for (unsigned step = 1; step <= nsteps; ++step)
-        {
-            deaths_and_parents(rng, parents, psurvival, births);
-            generate_births(rng, births, littler, breakpoints, nsteps - step,
-                            buffer_new_edges, new_edges, parents, tables);
-            if (step % simplification_interval == 0.)
-                {
-                    samples.clear();
-                    for (auto& p : parents)
+    tsk_size_t edges_at_last_simplification = tables->edges.num_rows;
+    double littler = options.rho / (4. * static_cast<double>(N));
+    // Without recombination, we use versions of draw_meioses and
+    // generate_births that give each meiosis a single edge.
+    const bool recombination = littler > 0.;
+    Meioses meioses;
+    CounterRNG counter_rng(options.seed);
+    std::vector<double> uniforms;
+    // Declared last, so that a running worker is
+    // joined before the state it uses is destroyed.
+    AsyncSimplification async;
+    auto current_memory_usage = [&]() {
+        return memory_usage(new_edges, parallel, async, edge_liftover, simplifier,
+                            windowed, tables);
+    };
+    SimplificationScheduler scheduler(simplification_interval, memory_budget);
+    bool warned_memory_budget = false;
+    // Recorded in the stats of each simplification
+    auto scheduler_threshold = [&]() -> std::size_t {
+        return options.adaptive_simplification ? scheduler.current_threshold() : 0;
+    };
+    unsigned steps_since_simplification = 0;
+    auto interval_start = std::chrono::steady_clock::now();
+    CheckpointWriter checkpoints(options.checkpoint);
+    unsigned num_simplifications = 0;
+    for (unsigned step = first_step; step <= nsteps; ++step)
+        {
+            {
+                PhaseTimer timer(stats, phase::parents);
+                if (options.counter_rng == false)
+                    {
+                        deaths_and_parents(rng, parent_nodes, options.psurvival,
+                                           births);
+                    }
+                else
+                    {
+                        deaths_and_parents(counter_rng, step, parent_nodes,
+                                           options.psurvival, uniforms, births);
+                    }
+            }
+            {
+                PhaseTimer timer(stats, phase::recombination);
+                const double L = tables->sequence_length;
+                const bool quantize = options.compact_buffer;
+                if (options.counter_rng == false && recombination)
+                    {
+                        draw_meioses<true>(rng, births.size(), littler, L, quantize,
+                                           meioses);
+                    }
+                else if (options.counter_rng == false)
+                    {
+                        draw_meioses<false>(rng, births.size(), littler, L, quantize,
+                                            meioses);
+                    }
+                else if (recombination)
+                    {
+                        draw_meioses<true>(counter_rng, step, births, littler, L,
+                                           quantize, parallel, meioses);
+                    }
+                else
+                    {
+                        draw_meioses<false>(counter_rng, step, births, littler, L,
+                                            quantize, parallel, meioses);
+                    }
+            }
+            {
+                PhaseTimer timer(stats, phase::births);
+                if (recombination)
+                    {
+                        generate_births<true>(births, meioses, nsteps - step,
+                                              buffer_new_edges, parallel, new_edges,
+                                              parent_nodes, tables);
+                    }
+                else
+                    {
+                        generate_births<false>(births, meioses, nsteps - step,
+                                               buffer_new_edges, parallel, new_edges,
+                                               parent_nodes, tables);
+                    }
+            }
+            if (options.prune_interval > 0 && step % options.prune_interval == 0)
+                {
+                    prune_buffered_births(parent_nodes, parallel, is_live, stats,
+                                          new_edges, tables);
+                }
+            ++steps_since_simplification;
+            const auto num_new_edges = edges_since_last_simplification(
+                buffer_new_edges, new_edges, parallel, edges_at_last_simplification,
+                tables);
+            const auto bytes = memory_in_use(new_edges, parallel, tables);
+            bool simplify_now = false;
+            if (options.adaptive_simplification == true)
+                {
+                    simplify_now = scheduler.should_simplify(
+                        num_new_edges, steps_since_simplification, bytes);
+                }
+            else
+                {
+                    simplify_now = step % simplification_interval == 0
+                                   || (memory_budget > 0
+                                       && bytes >= scheduler.current_memory_trigger());
+                }
+            if (simplify_now)
+                {
+                    if (options.async_simplify == true)
                         {
-                            samples.push_back(p.node0);
-                            samples.push_back(p.node1);
+                            finish_async_simplification(node_map, parallel, async,
+                                                        parent_nodes, new_edges, stats,
+                                                        tables);
                         }
+                    samples.assign(begin(parent_nodes), end(parent_nodes));
                     node_map.resize(tables->nodes.num_rows);
+                    if (buffer_new_edges == true)
+                        {
+                            merge_thread_buffers(parallel, stats, new_edges);
+                        }
 
+                    SimplificationRecord record(stats, step, scheduler_threshold(),
+                                                tables, new_edges, current_memory_usage);
                     if (buffer_new_edges == false)
                         {
-                            sort_n_simplify(cppsort, parallel_sort, last_time_simplified,
-                                            samples, node_map, tables);
+                            sort_n_simplify(cppsort, radix_sort, parallel_sort,
+                                            options.incremental_sort,
+                                            edges_at_last_simplification, samples,
+                                            node_map, windowed, arena, stats,
+                                            tables);
+                            record.finish(tables);
+                        }
+                    else if (options.async_simplify == true)
+                        {
+                            start_async_simplification(
+                                alive_at_last_simplification, parent_edge_index, samples,
+                                node_map, options.stitch_in_place,
+                                options.native_simplify, simplifier, windowed,
+                                new_edges, edge_liftover, async, record, stats, tables);
                         }
                     else
                         {
-                            flush_buffer_n_simplify(alive_at_last_simplification,
-                                                    samples, node_map, new_edges,
-                                                    edge_liftover, tables);
+                            flush_buffer_n_simplify(
+                                alive_at_last_simplification, parent_edge_index, samples,
+                                node_map, options.stitch_in_place,
+                                options.native_simplify, simplifier, windowed,
+                                stitch_arena, new_edges, edge_liftover, stats, tables);
+                            record.finish(tables);
                         }
                     simplified = true;
-                    last_time_simplified = nsteps - step;
-                    //remap parent nodes
-                    for (auto& p : parents)
+                    auto now = std::chrono::steady_clock::now();
+                    std::chrono::duration<double> dt = now - interval_start;
+                    scheduler.simplified(dt.count(), steps_since_simplification,
+                                         num_new_edges);
+                    steps_since_simplification = 0;
+                    interval_start = now;
+                    // With async_simplify, finish_async_simplification remaps nodes
+                    if (options.async_simplify == false)
                         {
-                            p.node0 = node_map[p.node0];
-                            p.node1 = node_map[p.node1];
+                            //remap parent nodes
+                            for (auto& u : parent_nodes)
+                                {
+                                    u = node_map[u];
+                                }
+                            if (buffer_new_edges == true)
+                                {
+                                    alive_at_last_simplification = parent_nodes;
+                                    index_parent_edges(tables,
+                                                       alive_at_last_simplification,
+                                                       parent_edge_index);
+                                }
+                            update_memory_trigger(
+                                memory_in_use(new_edges, parallel, tables), scheduler,
+                                warned_memory_budget);
                         }
-                    if (buffer_new_edges == true)
+                    ++num_simplifications;
+                    if (options.checkpoint.empty() == false
+                        && num_simplifications % options.checkpoint_interval == 0)
                         {
-                            alive_at_last_simplification.clear();
-                            for (auto& p : parents)
+                            PhaseTimer timer(stats, phase::checkpoint);
+                            if (checkpoints.write(
+                                    CheckpointState{nsteps, step, parent_nodes}, rng,
+                                    tables)
+                                    == false
+                                && stats != nullptr)
                                 {
-                                    alive_at_last_simplification.push_back(p.node0);
-                                    alive_at_last_simplification.push_back(p.node1);
+                                    ++stats->skipped_checkpoints;
                                 }
                         }
                 }
@@ -391,24 +1275,58 @@ simulate(const GSLrng& rng, unsigned N, double psurvival, unsigned nsteps,
                     simplified = false;
                 }
         }
+    if (options.async_simplify == true)
+        {
+            finish_async_simplification(node_map, parallel, async, parent_nodes,
+                                        new_edges, stats, tables);
+        }
     if (simplified == false)
         {
-            samples.clear();
-            for (auto& p : parents)
+            samples.assign(begin(parent_nodes), end(parent_nodes));
+            node_map.resize(tables->nodes.num_rows);
+            if (buffer_new_edges == true)
                 {
-                    samples.push_back(p.node0);
-                    samples.push_back(p.node1);
+                    merge_thread_buffers(parallel, stats, new_edges);
                 }
-            node_map.resize(tables->nodes.num_rows);
+            SimplificationRecord record(stats, nsteps, scheduler_threshold(), tables,
+                                        new_edges, current_memory_usage);
             if (buffer_new_edges == false)
                 {
-                    sort_n_simplify(cppsort, parallel_sort, last_time_simplified,
-                                    samples, node_map, tables);
+                    sort_n_simplify(cppsort, radix_sort, parallel_sort,
+                                    options.incremental_sort,
+                                    edges_at_last_simplification, samples, node_map,
+                                    windowed, arena, stats, tables);
                 }
             else
                 {
-                    flush_buffer_n_simplify(alive_at_last_simplification, samples,
-                                            node_map, new_edges, edge_liftover, tables);
+                    flush_buffer_n_simplify(alive_at_last_simplification,
+                                            parent_edge_index, samples, node_map,
+                                            options.stitch_in_place,
+                                            options.native_simplify, simplifier,
+                                            windowed, stitch_arena, new_edges,
+                                            edge_liftover, stats, tables);
                 }
+            record.finish(tables);
+        }
+    if (stats != nullptr)
+        {
+            stats->final_bytes = current_memory_usage();
+            stats->record_memory(stats->final_bytes);
         }
+    checkpoints.wait();
+}
+
+void
+simulate(const GSLrng& rng, const command_line_options& options,
+         SimulationStats* stats, table_collection_ptr& tables)
+{
+    simulate_from(rng, options, nullptr, stats, tables);
+}
+
+void
+resume_simulation(const GSLrng& rng, const command_line_options& options,
+                  const CheckpointState& state, SimulationStats* stats,
+                  table_collection_ptr& tables)
+{
+    simulate_from(rng, options, &state, stats, tables);
 }
@@ -2,8 +2,15 @@
 
 #include "rng.hpp"
 #include "tskit_tools.hpp"
+#include "options.hpp"
+#include "stats.hpp"
+#include "checkpoint.hpp"
 
-void simulate(const GSLrng& rng, unsigned N, double psurvival, unsigned nsteps,
-              unsigned simplification_interval, double rho, bool buffer_new_edges,
-              bool cppsort, bool parallel_sort,
-              table_collection_ptr& tables);
+void simulate(const GSLrng& rng, const command_line_options& options,
+              SimulationStats* stats, table_collection_ptr& tables);
+
+// Continue a simulation from a checkpoint.  rng and tables
+// must be as restored by read_checkpoint.
+void resume_simulation(const GSLrng& rng, const command_line_options& options,
+                       const CheckpointState& state, SimulationStats* stats,
+                       table_collection_ptr& tables);
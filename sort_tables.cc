@@ -1,14 +1,12 @@
 #include <vector>
+#include <array>
+#include <cstdint>
+#include <limits>
 #include <stdexcept>
 #include <algorithm>
-// We need a really good compiler here.
-// First, we are checking for C++ >= C++17.
-// If that check passes, we use the (absolutely
-// incredible) C++17 macro to test for header existence,
-// which saves us headaches in our build system.
-#if __cplusplus >= 201703L && __has_include(<execution>)
-#include <execution>
-#endif
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
 #include <tskit.h>
 
 struct _edge
@@ -16,8 +14,8 @@ struct _edge
     double left, right;
     tsk_id_t parent, child;
 
-    // NOTE: this constuctor must exist or the TBB back-end
-    // for the parallel sort won't compile
+    // NOTE: this constuctor must exist or tbb::parallel_sort
+    // won't compile
     _edge() : left{}, right{}, parent{TSK_NULL}, child{TSK_NULL}
     {
     }
@@ -28,25 +26,35 @@ struct _edge
     }
 };
 
-void
-sort_tables(tsk_table_collection_t* tables, bool parallel)
-// Re-implementation of the copy/sort/copy
-// semantics that tskit implements for an edge table.
-// If (full) C++17 is available, then we provide
-// the option of sorting using the parallel algorithm
-// library.
-// The parallel method requires a compiler that is not
-// on conda.  More seriously, if you do find GCC9 on conda,
-// you should NOT use it unless you also recompile ALL C++
-// dependencies with it!  You risk runtime crashes otherwise,
-// because C++ kinda stinks that way.
+static void
+copy_edges_to_table(const std::vector<_edge>& edges, tsk_size_t first_row,
+                    tsk_edge_table_t& table)
+{
+    for (std::size_t i = 0; i < edges.size(); ++i)
+        {
+            table.left[first_row + i] = edges[i].left;
+            table.right[first_row + i] = edges[i].right;
+            table.parent[first_row + i] = edges[i].parent;
+            table.child[first_row + i] = edges[i].child;
+        }
+}
+
+static std::vector<_edge>
+sort_edge_rows(const tsk_table_collection_t* tables, tsk_size_t first_row,
+               bool parallel)
+// Re-implementation of the copy/sort
+// semantics that tskit implements for an edge table,
+// applied to the rows from first_row onwards.
+// If parallel, we sort with tbb::parallel_sort, which
+// uses the threads of the task arena that we are called
+// from, so that the caller controls how many there are.
 {
     // We need some check here to say "If there are edge
     // metadata, throw an exception", or update this to
     // copy the metadata,  too.
     std::vector<_edge> edges;
-    edges.reserve(tables->edges.num_rows);
-    for (decltype(tables->edges.num_rows) i = 0; i < tables->edges.num_rows; ++i)
+    edges.reserve(tables->edges.num_rows - first_row);
+    for (auto i = first_row; i < tables->edges.num_rows; ++i)
         {
             edges.emplace_back(tables->edges.left[i], tables->edges.right[i],
                                tables->edges.parent[i], tables->edges.child[i]);
@@ -75,41 +83,393 @@ sort_tables(tsk_table_collection_t* tables, bool parallel)
         return tl < tr;
     };
 
-#if __cplusplus >= 201703L && __has_include(<execution>)
     if (parallel == false)
         {
             std::sort(begin(edges), end(edges), cmp);
         }
     else
         {
-            // The support for C++17 parallel algorithms first pops up
-            // in GCC9.1 or thereabouts.  No idea about clang.
-            // I will assume that this just deletes your hard drive
-            // on Windows? ;)
-            // The GCC implementation is backed by Intel's excellent
-            // TBB library, which becomes a run time dependency
-            // and so we need -ltbb.
-            // Like OMP, etc., this is "greedy" parallelism, and will
-            // auto-determine the size of the thread pool.  I have not
-            // experimented if the thread pool size can be controlled
-            // using the standard TBB API.  Even if it can, that is not
-            // portable, as the implementation of the thread pool
-            // is up to the compiler vendor.
-            // Unlike OMP, TBB does NOT allow the pool size to be set
-            // by an environment variable.
-            std::sort(std::execution::par, begin(edges), end(edges), cmp);
+            tbb::parallel_sort(begin(edges), end(edges), cmp);
         }
-#else
-    // Default to sequential algorithm.
-    std::sort(begin(edges), end(edges), cmp);
-#endif
+    return edges;
+}
 
-    for (std::size_t i = 0; i < edges.size(); ++i)
+void
+sort_tables(tsk_table_collection_t* tables, bool parallel)
+// Re-implementation of the copy/sort/copy
+// semantics that tskit implements for an edge table.
+{
+    copy_edges_to_table(sort_edge_rows(tables, 0, parallel), 0, tables->edges);
+}
+
+namespace
+{
+    // Each edge is sorted by a single integer key,
+    // (time rank, parent, child), packed into 64 bits.
+    // The index is the edge's row in the input table.
+    struct keyed_edge
+    {
+        std::uint64_t key;
+        tsk_size_t index;
+    };
+
+    constexpr unsigned RADIX_BITS = 8;
+    constexpr std::size_t RADIX_BUCKETS = 1 << RADIX_BITS;
+
+    unsigned
+    bits_needed(std::uint64_t n)
+    // Number of bits needed to store values in [0, n)
+    {
+        unsigned b = 0;
+        while (n > 1 && ((n - 1) >> b) != 0)
+            {
+                ++b;
+            }
+        return b;
+    }
+
+    std::size_t
+    digit(std::uint64_t key, unsigned shift)
+    {
+        return (key >> shift) & (RADIX_BUCKETS - 1);
+    }
+
+    void
+    lsd_radix_sort(keyed_edge* first, keyed_edge* last, keyed_edge* scratch,
+                   unsigned bits)
+    // Sort [first, last) by the lowest bits of the key,
+    // using scratch, which must have room for last - first
+    // elements.  The result is in [first, last).
+    // The histograms for all digits are made in one pass,
+    // and digits where every key falls in one bucket are
+    // skipped.
+    {
+        const std::size_t n = last - first;
+        if (n < 2)
+            {
+                return;
+            }
+        const unsigned npasses = (bits + RADIX_BITS - 1) / RADIX_BITS;
+        std::vector<std::array<std::size_t, RADIX_BUCKETS>> counts(npasses);
+        for (auto& c : counts)
+            {
+                c.fill(0);
+            }
+        for (auto i = first; i < last; ++i)
+            {
+                for (unsigned pass = 0; pass < npasses; ++pass)
+                    {
+                        ++counts[pass][digit(i->key, pass * RADIX_BITS)];
+                    }
+            }
+        keyed_edge* from = first;
+        keyed_edge* to = scratch;
+        for (unsigned pass = 0; pass < npasses; ++pass)
+            {
+                auto& c = counts[pass];
+                const unsigned shift = pass * RADIX_BITS;
+                if (c[digit(from->key, shift)] == n)
+                    {
+                        continue;
+                    }
+                std::size_t offset = 0;
+                for (auto& ci : c)
+                    {
+                        auto t = ci;
+                        ci = offset;
+                        offset += t;
+                    }
+                for (std::size_t i = 0; i < n; ++i)
+                    {
+                        to[c[digit(from[i].key, shift)]++] = from[i];
+                    }
+                std::swap(from, to);
+            }
+        if (from != first)
+            {
+                std::copy(from, from + n, first);
+            }
+    }
+
+    void
+    sort_equal_keys_by_left(keyed_edge* first, keyed_edge* last,
+                            const tsk_edge_table_t& edges)
+    // Runs of equal keys are edges with the same parent
+    // and child.  These runs are short, and we finish
+    // the sort by ordering them by left.
+    {
+        while (first < last)
+            {
+                auto run_end = first + 1;
+                while (run_end < last && run_end->key == first->key)
+                    {
+                        ++run_end;
+                    }
+                if (run_end - first > 1)
+                    {
+                        std::sort(first, run_end,
+                                  [&edges](const keyed_edge& a, const keyed_edge& b) {
+                                      return edges.left[a.index] < edges.left[b.index];
+                                  });
+                    }
+                first = run_end;
+            }
+    }
+
+    void
+    parallel_radix_sort(std::vector<keyed_edge>& keys, std::vector<keyed_edge>& scratch,
+                        unsigned bits, const tsk_edge_table_t& edges)
+    // One MSD pass on the top digit, done in blocks in parallel,
+    // followed by an LSD sort of each bucket in parallel.
+    // The result is in keys.
+    {
+        const std::size_t n = keys.size();
+        const unsigned shift = bits > RADIX_BITS ? bits - RADIX_BITS : 0;
+        const std::size_t block_size = 1 << 16;
+        const std::size_t nblocks = (n + block_size - 1) / block_size;
+        std::vector<std::array<std::size_t, RADIX_BUCKETS>> counts(nblocks);
+        tbb::parallel_for(std::size_t(0), nblocks, [&](std::size_t b) {
+            auto& c = counts[b];
+            c.fill(0);
+            auto stop = std::min(n, (b + 1) * block_size);
+            for (std::size_t i = b * block_size; i < stop; ++i)
+                {
+                    ++c[digit(keys[i].key, shift)];
+                }
+        });
+        std::array<std::size_t, RADIX_BUCKETS + 1> bucket_start;
+        std::size_t offset = 0;
+        for (std::size_t d = 0; d < RADIX_BUCKETS; ++d)
+            {
+                bucket_start[d] = offset;
+                for (auto& c : counts)
+                    {
+                        auto t = c[d];
+                        c[d] = offset;
+                        offset += t;
+                    }
+            }
+        bucket_start[RADIX_BUCKETS] = n;
+        tbb::parallel_for(std::size_t(0), nblocks, [&](std::size_t b) {
+            auto& c = counts[b];
+            auto stop = std::min(n, (b + 1) * block_size);
+            for (std::size_t i = b * block_size; i < stop; ++i)
+                {
+                    scratch[c[digit(keys[i].key, shift)]++] = keys[i];
+                }
+        });
+        tbb::parallel_for(std::size_t(0), RADIX_BUCKETS, [&](std::size_t d) {
+            auto first = scratch.data() + bucket_start[d];
+            auto last = scratch.data() + bucket_start[d + 1];
+            lsd_radix_sort(first, last, keys.data() + bucket_start[d], shift);
+            sort_equal_keys_by_left(first, last, edges);
+        });
+        keys.swap(scratch);
+    }
+}
+
+template <typename F>
+static void
+for_each_block(std::size_t n, bool parallel, F f)
+// Call f(first, last) on blocks covering [0, n),
+// in parallel if requested.
+{
+    if (parallel == false)
+        {
+            f(std::size_t(0), n);
+            return;
+        }
+    tbb::parallel_for(tbb::blocked_range<std::size_t>(0, n),
+                      [&f](const tbb::blocked_range<std::size_t>& r) {
+                          f(r.begin(), r.end());
+                      });
+}
+
+static std::vector<std::uint32_t>
+rank_node_times(const tsk_node_table_t& nodes, bool parallel, std::size_t& num_ranks)
+// The rank of each node's time among the distinct node times.
+// Nodes are recorded a generation at a time, so the node table
+// is made of runs of equal times, and only the first time of
+// each run is sorted.
+{
+    const std::size_t num_nodes = nodes.num_rows;
+    std::vector<double> distinct_times;
+    for (std::size_t i = 0; i < num_nodes; ++i)
         {
-            tables->edges.left[i] = edges[i].left;
-            tables->edges.right[i] = edges[i].right;
-            tables->edges.parent[i] = edges[i].parent;
-            tables->edges.child[i] = edges[i].child;
+            if (i == 0 || nodes.time[i] != nodes.time[i - 1])
+                {
+                    distinct_times.push_back(nodes.time[i]);
+                }
         }
+    std::sort(begin(distinct_times), end(distinct_times));
+    distinct_times.erase(std::unique(begin(distinct_times), end(distinct_times)),
+                         end(distinct_times));
+    num_ranks = distinct_times.size();
+
+    std::vector<std::uint32_t> rank(num_nodes);
+    for_each_block(num_nodes, parallel, [&](std::size_t first, std::size_t last) {
+        for (auto i = first; i < last; ++i)
+            {
+                if (i == first || nodes.time[i] != nodes.time[i - 1])
+                    {
+                        rank[i] = std::lower_bound(begin(distinct_times),
+                                                   end(distinct_times), nodes.time[i])
+                                  - begin(distinct_times);
+                    }
+                else
+                    {
+                        rank[i] = rank[i - 1];
+                    }
+            }
+    });
+    return rank;
 }
 
+static std::vector<_edge>
+radix_sort_edge_rows(const tsk_table_collection_t* tables, tsk_size_t first_row,
+                     bool parallel)
+// Same result as sort_edge_rows, but sorting on integer keys
+// rather than comparing node times.  Parent times are
+// replaced by their rank among the distinct node times,
+// and the key is the bits of (rank, parent, child).
+// Ties are edges with the same parent and child,
+// which are then sorted by left.
+// If the key does not fit in 64 bits, we use sort_edge_rows.
+{
+    const auto& nodes = tables->nodes;
+    const auto& edges = tables->edges;
+    const std::size_t n = edges.num_rows - first_row;
+
+    std::size_t num_ranks;
+    const auto time_rank = rank_node_times(nodes, parallel, num_ranks);
+    const unsigned node_bits = bits_needed(nodes.num_rows);
+    const unsigned bits = bits_needed(num_ranks) + 2 * node_bits;
+    if (bits > 64)
+        {
+            return sort_edge_rows(tables, first_row, parallel);
+        }
+
+    std::vector<keyed_edge> keys(n), scratch(n);
+    for_each_block(n, parallel, [&](std::size_t first, std::size_t last) {
+        for (auto i = first; i < last; ++i)
+            {
+                auto row = first_row + i;
+                std::uint64_t p = edges.parent[row], c = edges.child[row];
+                keys[i].key = (std::uint64_t{time_rank[p]} << (2 * node_bits))
+                              | (p << node_bits) | c;
+                keys[i].index = row;
+            }
+    });
+    if (parallel == false)
+        {
+            lsd_radix_sort(keys.data(), keys.data() + n, scratch.data(), bits);
+            sort_equal_keys_by_left(keys.data(), keys.data() + n, edges);
+        }
+    else
+        {
+            parallel_radix_sort(keys, scratch, bits, edges);
+        }
+
+    std::vector<_edge> sorted;
+    sorted.reserve(n);
+    for (auto& k : keys)
+        {
+            sorted.emplace_back(edges.left[k.index], edges.right[k.index],
+                                edges.parent[k.index], edges.child[k.index]);
+        }
+    return sorted;
+}
+
+void
+radix_sort_tables(tsk_table_collection_t* tables, bool parallel)
+{
+    copy_edges_to_table(radix_sort_edge_rows(tables, 0, parallel), 0, tables->edges);
+}
+
+void
+sort_new_edges_and_merge(tsk_table_collection_t* tables, tsk_size_t num_sorted_rows,
+                         bool radix, bool parallel)
+// The first num_sorted_rows edges are the output of the
+// last simplification.  They are sorted by parent time,
+// and the edges of each parent are contiguous and sorted
+// by child and left, but parents with the same time need
+// not be in order of their IDs.  So, rather than a merge
+// on the full sort order, we sort the newer rows and merge
+// the two lists parent-by-parent, like stitching an
+// EdgeBuffer:
+//
+// 1. The new edges of a parent that has sorted edges
+//    go right after them.  Their children are newer nodes
+//    than any child in the sorted rows, so the edges
+//    stay sorted by child.
+// 2. The edges of a new parent go before the next sorted
+//    parent whose time is greater.
+{
+    auto& table = tables->edges;
+    const auto& time = tables->nodes.time;
+    if (num_sorted_rows > table.num_rows)
+        {
+            throw std::invalid_argument("num_sorted_rows > num_rows");
+        }
+    auto new_edges = radix ? radix_sort_edge_rows(tables, num_sorted_rows, parallel)
+                           : sort_edge_rows(tables, num_sorted_rows, parallel);
+    if (num_sorted_rows == 0)
+        {
+            copy_edges_to_table(new_edges, 0, table);
+            return;
+        }
+
+    // Where each parent's run of new edges starts.
+    const std::size_t none = std::numeric_limits<std::size_t>::max();
+    std::vector<std::size_t> new_run_start(tables->nodes.num_rows, none);
+    for (std::size_t i = 0; i < new_edges.size(); ++i)
+        {
+            if (i == 0 || new_edges[i].parent != new_edges[i - 1].parent)
+                {
+                    new_run_start[new_edges[i].parent] = i;
+                }
+        }
+
+    std::vector<_edge> merged;
+    merged.reserve(table.num_rows);
+    auto merge_new_run = [&](std::size_t i) {
+        // Copy the run starting at i, unless it was
+        // already merged, and return the end of the run.
+        auto p = new_edges[i].parent;
+        const bool copy = new_run_start[p] == i;
+        new_run_start[p] = none;
+        for (; i < new_edges.size() && new_edges[i].parent == p; ++i)
+            {
+                if (copy)
+                    {
+                        merged.push_back(new_edges[i]);
+                    }
+            }
+        return i;
+    };
+    std::size_t next_new = 0;
+    tsk_size_t row = 0;
+    while (row < num_sorted_rows)
+        {
+            auto p = table.parent[row];
+            while (next_new < new_edges.size()
+                   && time[new_edges[next_new].parent] < time[p])
+                {
+                    next_new = merge_new_run(next_new);
+                }
+            for (; row < num_sorted_rows && table.parent[row] == p; ++row)
+                {
+                    merged.emplace_back(table.left[row], table.right[row], p,
+                                        table.child[row]);
+                }
+            if (new_run_start[p] != none)
+                {
+                    merge_new_run(new_run_start[p]);
+                }
+        }
+    while (next_new < new_edges.size())
+        {
+            next_new = merge_new_run(next_new);
+        }
+    copy_edges_to_table(merged, 0, table);
+}
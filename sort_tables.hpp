@@ -3,3 +3,6 @@
 #include <tskit.h>
 
 void sort_tables(tsk_table_collection_t* tables, bool parallel);
+void radix_sort_tables(tsk_table_collection_t* tables, bool parallel);
+void sort_new_edges_and_merge(tsk_table_collection_t* tables, tsk_size_t num_sorted_rows,
+                              bool radix, bool parallel);
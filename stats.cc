@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include "stats.hpp"
+
+const char*
+phase_name(phase p)
+{
+    switch (p)
+        {
+        case phase::parents:
+            return "parents";
+        case phase::recombination:
+            return "recombination";
+        case phase::births:
+            return "births";
+        case phase::merge_buffers:
+            return "merge_buffers";
+        case phase::prune:
+            return "prune";
+        case phase::stitch_copy:
+            return "stitch_copy";
+        case phase::stitch_find:
+            return "stitch_find";
+        case phase::stitch_handle:
+            return "stitch_handle";
+        case phase::sort:
+            return "sort";
+        case phase::simplify:
+            return "simplify";
+        case phase::remap:
+            return "remap";
+        case phase::checkpoint:
+            return "checkpoint";
+        default:
+            break;
+        }
+    throw std::invalid_argument("invalid phase");
+}
+
+const char*
+memory_component_name(memory_component c)
+{
+    switch (c)
+        {
+        case memory_component::edge_buffer:
+            return "edge_buffer";
+        case memory_component::temp_edges:
+            return "temp_edges";
+        case memory_component::simplifier:
+            return "simplifier";
+        case memory_component::node_table:
+            return "node_table";
+        case memory_component::edge_table:
+            return "edge_table";
+        default:
+            break;
+        }
+    throw std::invalid_argument("invalid memory component");
+}
+
+SimulationStats::SimulationStats()
+    : seconds{}, calls{}, simplifications{}, peak_bytes{}, final_bytes{},
+      total_seconds{0.}, pruned_births{0}, skipped_checkpoints{0}
+{
+    seconds.fill(0.);
+    calls.fill(0);
+    peak_bytes.fill(0);
+    final_bytes.fill(0);
+}
+
+void
+SimulationStats::record_memory(const MemoryUsage& bytes)
+{
+    for (std::size_t i = 0; i < NUM_MEMORY_COMPONENTS; ++i)
+        {
+            peak_bytes[i] = std::max(peak_bytes[i], bytes[i]);
+        }
+}
+
+PhaseTimer::PhaseTimer(SimulationStats* s, phase p_)
+    : stats{s}, p{p_}, start{stats == nullptr ? clock::time_point{} : clock::now()}
+{
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    if (stats != nullptr)
+        {
+            std::chrono::duration<double> dt = clock::now() - start;
+            auto i = static_cast<std::size_t>(p);
+            stats->seconds[i] += dt.count();
+            ++stats->calls[i];
+        }
+}
+
+static std::string
+json_string(const std::string& s)
+// s quoted, with the characters that JSON
+// does not allow in strings escaped.
+{
+    std::ostringstream o;
+    o << '"';
+    for (unsigned char c : s)
+        {
+            if (c == '"' || c == '\\')
+                {
+                    o << '\\' << c;
+                }
+            else if (c < 0x20)
+                {
+                    o << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                      << static_cast<int>(c) << std::dec;
+                }
+            else
+                {
+                    o << c;
+                }
+        }
+    o << '"';
+    return o.str();
+}
+
+static void
+write_memory_usage(std::ostream& out, const MemoryUsage& bytes)
+{
+    out << '{';
+    for (std::size_t i = 0; i < NUM_MEMORY_COMPONENTS; ++i)
+        {
+            out << '"' << memory_component_name(static_cast<memory_component>(i))
+                << "\": " << bytes[i] << (i + 1 < NUM_MEMORY_COMPONENTS ? ", " : "");
+        }
+    out << '}';
+}
+
+void
+write_stats_json(const SimulationStats& stats, const command_line_options& options,
+                 const std::string& filename)
+// The output is written by hand, as it is simple
+// and we don't want a JSON library as a dependency.
+{
+    std::ofstream out(filename);
+    if (!out)
+        {
+            throw std::runtime_error("could not open " + filename);
+        }
+    out << std::setprecision(9) << std::boolalpha;
+    out << "{\n";
+    out << "  \"options\": {\n"
+        << "    \"N\": " << options.N << ",\n"
+        << "    \"psurvival\": " << options.psurvival << ",\n"
+        << "    \"nsteps\": " << options.nsteps << ",\n"
+        << "    \"simplify\": ";
+    if (options.adaptive_simplification)
+        {
+            out << "\"auto\"";
+        }
+    else
+        {
+            out << options.simplification_interval;
+        }
+    out << ",\n"
+        << "    \"mem_budget\": " << options.mem_budget << ",\n"
+        << "    \"rho\": " << options.rho << ",\n"
+        << "    \"buffer\": " << options.buffer_new_edges << ",\n"
+        << "    \"stitch_in_place\": " << options.stitch_in_place << ",\n"
+        << "    \"native_simplify\": " << options.native_simplify << ",\n"
+        << "    \"async_simplify\": " << options.async_simplify << ",\n"
+        << "    \"simplify_windows\": " << options.simplify_windows << ",\n"
+        << "    \"prune_interval\": " << options.prune_interval << ",\n"
+        << "    \"compact_buffer\": " << options.compact_buffer << ",\n"
+        << "    \"cppsort\": " << options.cppsort << ",\n"
+        << "    \"parallel_sort\": " << options.parallel_sort << ",\n"
+        << "    \"sort\": " << json_string(options.sort_method) << ",\n"
+        << "    \"incremental_sort\": " << options.incremental_sort << ",\n"
+        << "    \"threads\": " << options.nthreads << ",\n"
+        << "    \"numa_node\": " << options.numa_node << ",\n"
+        << "    \"counter_rng\": " << options.counter_rng << ",\n"
+        << "    \"seed\": " << options.seed << ",\n"
+        << "    \"checkpoint\": " << json_string(options.checkpoint) << ",\n"
+        << "    \"checkpoint_interval\": " << options.checkpoint_interval << ",\n"
+        << "    \"resume\": " << json_string(options.resume) << ",\n"
+        << "    \"verify\": " << options.verify << "\n"
+        << "  },\n";
+    out << "  \"total_seconds\": " << stats.total_seconds << ",\n";
+    out << "  \"pruned_births\": " << stats.pruned_births << ",\n";
+    out << "  \"skipped_checkpoints\": " << stats.skipped_checkpoints << ",\n";
+    out << "  \"phases\": {\n";
+    for (std::size_t i = 0; i < NUM_PHASES; ++i)
+        {
+            out << "    \"" << phase_name(static_cast<phase>(i)) << "\": {\"seconds\": "
+                << stats.seconds[i] << ", \"calls\": " << stats.calls[i] << '}'
+                << (i + 1 < NUM_PHASES ? ",\n" : "\n");
+        }
+    out << "  },\n";
+    out << "  \"peak_bytes\": ";
+    write_memory_usage(out, stats.peak_bytes);
+    out << ",\n  \"final_bytes\": ";
+    write_memory_usage(out, stats.final_bytes);
+    out << ",\n";
+    out << "  \"simplifications\": [\n";
+    for (std::size_t i = 0; i < stats.simplifications.size(); ++i)
+        {
+            const auto& s = stats.simplifications[i];
+            out << "    {\"step\": " << s.step << ", \"threshold\": " << s.threshold
+                << ", \"nodes_before\": " << s.nodes_before
+                << ", \"edges_before\": " << s.edges_before
+                << ", \"buffered_edges\": " << s.buffered_edges
+                << ", \"nodes_after\": " << s.nodes_after
+                << ", \"edges_after\": " << s.edges_after << ", \"seconds\": " << s.seconds
+                << ", \"bytes\": ";
+            write_memory_usage(out, s.bytes);
+            out << '}' << (i + 1 < stats.simplifications.size() ? ",\n" : "\n");
+        }
+    out << "  ]\n";
+    out << "}\n";
+}
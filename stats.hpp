@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "options.hpp"
+
+enum class phase : std::size_t
+{
+    parents,       // deaths and choosing parents
+    recombination, // drawing breakpoints
+    births,        // recording nodes and recording or buffering edges
+    merge_buffers, // merging the edge buffers of threads
+    prune,         // removing buffered births to children without descendants
+    stitch_copy,   // copying births to parents born since the last simplification
+    stitch_find,   // finding where births to older parents go
+    stitch_handle, // merging births to older parents with existing edges
+    sort,
+    simplify,
+    remap,         // remapping nodes after --async_simplify
+    checkpoint,    // copying the state for --checkpoint
+    num_phases
+};
+
+constexpr std::size_t NUM_PHASES = static_cast<std::size_t>(phase::num_phases);
+
+const char* phase_name(phase p);
+
+enum class memory_component : std::size_t
+{
+    edge_buffer, // EdgeBuffers, including those of threads
+    temp_edges,  // edge liftover for stitching, and edges of threads
+    simplifier,  // working storage of BufferedSimplifier
+    node_table,
+    edge_table,
+    num_components
+};
+
+constexpr std::size_t NUM_MEMORY_COMPONENTS
+    = static_cast<std::size_t>(memory_component::num_components);
+
+const char* memory_component_name(memory_component c);
+
+// Bytes allocated for each component, counting capacity rather than size.
+using MemoryUsage = std::array<std::uint64_t, NUM_MEMORY_COMPONENTS>;
+
+struct SimplificationStats
+// Table sizes around one simplification, and memory use
+// right before it.  threshold is the number of new edges at
+// which --simplify auto would simplify, and 0 otherwise.
+{
+    unsigned step;
+    std::uint64_t threshold;
+    std::uint64_t nodes_before, edges_before, buffered_edges;
+    std::uint64_t nodes_after, edges_after;
+    double seconds;
+    MemoryUsage bytes;
+};
+
+struct SimulationStats
+{
+    std::array<double, NUM_PHASES> seconds;
+    std::array<std::uint64_t, NUM_PHASES> calls;
+    std::vector<SimplificationStats> simplifications;
+    // Largest sample of each component, and the sample
+    // taken at the end of the simulation.
+    MemoryUsage peak_bytes, final_bytes;
+    double total_seconds;
+    // Births removed by --prune_interval
+    std::uint64_t pruned_births;
+    // Checkpoints not taken because the last one
+    // was still being written
+    std::uint64_t skipped_checkpoints;
+
+    SimulationStats();
+    void record_memory(const MemoryUsage& bytes);
+};
+
+class PhaseTimer
+// Adds the time between construction and destruction
+// to a phase.  Does nothing if stats is nullptr.
+{
+  private:
+    using clock = std::chrono::steady_clock;
+    SimulationStats* stats;
+    phase p;
+    clock::time_point start;
+
+  public:
+    PhaseTimer(SimulationStats* s, phase p_);
+    ~PhaseTimer();
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+};
+
+void write_stats_json(const SimulationStats& stats, const command_line_options& options,
+                      const std::string& filename);
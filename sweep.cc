@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+#include "rng.hpp"
+#include "simulate.hpp"
+#include "stats.hpp"
+#include "sweep.hpp"
+#include "tskit_tools.hpp"
+
+namespace
+{
+    struct SweepRun
+    {
+        command_line_options options;
+        std::string method;
+        unsigned replicate;
+        // Results
+        double seconds;
+        std::array<double, NUM_PHASES> phase_seconds;
+        std::uint64_t sampled_peak_bytes, nodes, edges, checksum;
+
+        SweepRun(const command_line_options& o, const std::string& m, unsigned r)
+            : options{o}, method{m}, replicate{r}, seconds{0.}, phase_seconds{},
+              sampled_peak_bytes{0}, nodes{0}, edges{0}, checksum{0}
+        {
+        }
+    };
+
+    void
+    set_method(const std::string& method, command_line_options& o)
+    {
+        o.sort_method = method == "radix" ? "radix" : "comparison";
+        o.buffer_new_edges = method.compare(0, 6, "buffer") == 0;
+        o.stitch_in_place = method == "buffer_in_place";
+        o.native_simplify = method == "buffer_native";
+    }
+
+    template <typename Values, typename Set>
+    void
+    expand_grid(const Values& values, Set set, std::vector<SweepRun>& runs)
+    // Replace each run with one run for each value.
+    {
+        std::vector<SweepRun> expanded;
+        for (const auto& r : runs)
+            {
+                for (const auto& v : values)
+                    {
+                        expanded.push_back(r);
+                        set(v, expanded.back());
+                    }
+            }
+        runs.swap(expanded);
+    }
+
+    template <typename T>
+    void
+    hash_column(const T* column, tsk_size_t n, std::uint64_t& h)
+    // 64-bit FNV-1a
+    {
+        auto bytes = reinterpret_cast<const unsigned char*>(column);
+        for (std::size_t i = 0; i < n * sizeof(T); ++i)
+            {
+                h ^= bytes[i];
+                h *= 0x100000001b3ULL;
+            }
+    }
+
+    std::uint64_t
+    table_checksum(const table_collection_ptr& tables)
+    // A hash of the node and edge tables, so that runs can be
+    // compared without writing them to files.
+    {
+        std::uint64_t h = 0xcbf29ce484222325ULL;
+        const auto& nodes = tables->nodes;
+        hash_column(nodes.flags, nodes.num_rows, h);
+        hash_column(nodes.time, nodes.num_rows, h);
+        const auto& edges = tables->edges;
+        hash_column(edges.left, edges.num_rows, h);
+        hash_column(edges.right, edges.num_rows, h);
+        hash_column(edges.parent, edges.num_rows, h);
+        hash_column(edges.child, edges.num_rows, h);
+        return h;
+    }
+
+    std::uint64_t
+    total_bytes(const MemoryUsage& bytes)
+    {
+        std::uint64_t total = 0;
+        for (auto b : bytes)
+            {
+                total += b;
+            }
+        return total;
+    }
+
+    std::uint64_t
+    sampled_peak_memory(const SimulationStats& stats)
+    // The largest memory use over the samples taken right
+    // before each simplification and at the end.  This is
+    // not a high-water mark, which we cannot take per run
+    // while runs share the process.
+    {
+        auto peak = total_bytes(stats.final_bytes);
+        for (const auto& s : stats.simplifications)
+            {
+                peak = std::max(peak, total_bytes(s.bytes));
+            }
+        return peak;
+    }
+
+    void
+    run(SweepRun& r)
+    {
+        auto rng = make_rng(r.options.seed);
+        auto tables = make_table_collection_ptr(1.);
+        SimulationStats stats;
+        auto start = std::chrono::steady_clock::now();
+        simulate(rng, r.options, &stats, tables);
+        std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+        r.seconds = dt.count();
+        r.phase_seconds = stats.seconds;
+        r.sampled_peak_bytes = sampled_peak_memory(stats);
+        r.nodes = tables->nodes.num_rows;
+        r.edges = tables->edges.num_rows;
+        r.checksum = table_checksum(tables);
+    }
+
+    void
+    write_results(const std::vector<SweepRun>& runs, std::ostream& out)
+    {
+        out << "N psurvival rho nsteps simplify method threads replicate seed seconds";
+        for (std::size_t i = 0; i < NUM_PHASES; ++i)
+            {
+                out << ' ' << phase_name(static_cast<phase>(i)) << "_seconds";
+            }
+        out << " sampled_peak_bytes nodes edges checksum\n";
+        for (const auto& r : runs)
+            {
+                const auto& o = r.options;
+                out << o.N << ' ' << o.psurvival << ' ' << o.rho << ' ' << o.nsteps << ' '
+                    << o.simplification_interval << ' ' << r.method << ' ' << o.nthreads
+                    << ' ' << r.replicate << ' ' << o.seed << ' ' << r.seconds;
+                for (auto t : r.phase_seconds)
+                    {
+                        out << ' ' << t;
+                    }
+                out << ' ' << r.sampled_peak_bytes << ' ' << r.nodes << ' ' << r.edges
+                    << ' ' << std::hex << r.checksum << std::dec << '\n';
+            }
+    }
+}
+
+void
+run_sweep(const sweep_options& options)
+// Runs are independent, each with its own tables and random
+// number generator, and run concurrently on options.jobs threads.
+// Each run has its own arena of --threads threads.  More threads
+// than cores would time contention rather than the methods, so the
+// default number of jobs fits in the cores, and we reject more than
+// one job at a time if they do not fit.
+// The table of results is in the order of the parameter grid.
+// For the same parameters, seed, and threads, the methods that sort
+// must give the same tables, and so must the methods that buffer,
+// which we check after writing the results.  Sorting and buffering give
+// the same trees, but with nodes and edges in different orders.
+{
+    std::vector<SweepRun> runs{SweepRun(command_line_options(), "", 0)};
+    expand_grid(options.N, [](unsigned N, SweepRun& r) { r.options.N = N; }, runs);
+    expand_grid(options.psurvival,
+                [](double p, SweepRun& r) { r.options.psurvival = p; }, runs);
+    expand_grid(options.rho, [](double rho, SweepRun& r) { r.options.rho = rho; }, runs);
+    expand_grid(options.nsteps,
+                [](unsigned n, SweepRun& r) { r.options.nsteps = n; }, runs);
+    expand_grid(options.simplification_intervals,
+                [](unsigned s, SweepRun& r) { r.options.simplification_interval = s; },
+                runs);
+    std::vector<unsigned> replicates(options.replicates);
+    std::iota(begin(replicates), end(replicates), 0u);
+    expand_grid(replicates,
+                [&options](unsigned i, SweepRun& r) {
+                    r.replicate = i;
+                    r.options.seed = options.seed + i;
+                },
+                runs);
+    expand_grid(options.methods,
+                [](const std::string& m, SweepRun& r) {
+                    r.method = m;
+                    set_method(m, r.options);
+                },
+                runs);
+    expand_grid(options.threads,
+                [](unsigned n, SweepRun& r) {
+                    r.options.nthreads = n;
+                    validate_cli(r.options);
+                },
+                runs);
+
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    const unsigned threads
+        = *std::max_element(begin(options.threads), end(options.threads));
+    unsigned jobs = options.jobs;
+    if (jobs == 0)
+        {
+            jobs = std::max(1u, cores / threads);
+        }
+    else if (jobs > 1 && static_cast<std::uint64_t>(jobs) * threads > cores)
+        {
+            std::ostringstream msg;
+            msg << "jobs = " << jobs << " with threads = " << threads << " needs "
+                << static_cast<std::uint64_t>(jobs) * threads
+                << " cores, but there are " << cores;
+            throw std::invalid_argument(msg.str());
+        }
+    tbb::task_arena arena(static_cast<int>(jobs));
+    arena.execute([&runs]() {
+        // One run per task, as run times vary a lot over the grid
+        tbb::parallel_for(
+            tbb::blocked_range<std::size_t>(0, runs.size(), 1),
+            [&runs](const tbb::blocked_range<std::size_t>& range) {
+                for (auto i = range.begin(); i < range.end(); ++i)
+                    {
+                        run(runs[i]);
+                    }
+            },
+            tbb::simple_partitioner());
+    });
+
+    if (options.output.empty())
+        {
+            write_results(runs, std::cout);
+        }
+    else
+        {
+            std::ofstream out(options.output);
+            if (!out)
+                {
+                    throw std::runtime_error("could not open " + options.output);
+                }
+            write_results(runs, out);
+        }
+
+    std::map<
+        std::tuple<unsigned, double, double, unsigned, unsigned, unsigned, unsigned, bool>,
+        const SweepRun*>
+        first_run;
+    for (const auto& r : runs)
+        {
+            const auto& o = r.options;
+            auto key = std::make_tuple(o.N, o.psurvival, o.rho, o.nsteps,
+                                       o.simplification_interval, o.seed, o.nthreads,
+                                       o.buffer_new_edges);
+            auto f = first_run.emplace(key, &r).first->second;
+            if (f->checksum != r.checksum)
+                {
+                    std::ostringstream msg;
+                    msg << "methods " << f->method << " and " << r.method
+                        << " gave different tables for N = " << o.N
+                        << ", psurvival = " << o.psurvival << ", rho = " << o.rho
+                        << ", nsteps = " << o.nsteps
+                        << ", simplify = " << o.simplification_interval
+                        << ", seed = " << o.seed << ", threads = " << o.nthreads;
+                    throw std::runtime_error(msg.str());
+                }
+        }
+}
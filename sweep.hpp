@@ -0,0 +1,5 @@
+#pragma once
+
+#include "options.hpp"
+
+void run_sweep(const sweep_options& options);
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
 #include <stdexcept>
 #include "tskit_tools.hpp"
 
@@ -17,3 +20,104 @@ make_table_collection_ptr(double sequence_length)
         }
     return rv;
 }
+
+namespace
+{
+    template <typename T>
+    void
+    realloc_column(T*& column, std::size_t n)
+    {
+        auto p = static_cast<T*>(std::realloc(column, n * sizeof(T)));
+        if (p == nullptr)
+            {
+                throw std::runtime_error("could not grow table");
+            }
+        column = p;
+    }
+}
+
+void
+reserve_edge_table_rows(tsk_edge_table_t* edges, tsk_size_t num_rows)
+// Grow the edge table columns so that they can hold num_rows
+// rows, without changing the number of rows.  This lets us
+// write rows directly into the columns.  tskit allocates
+// table memory with malloc/realloc, so we can do the same.
+// Edge metadata are not supported.
+{
+    if (edges->metadata_length != 0)
+        {
+            throw std::invalid_argument("edge metadata are not supported");
+        }
+    if (num_rows <= edges->max_rows)
+        {
+            return;
+        }
+    realloc_column(edges->left, num_rows);
+    realloc_column(edges->right, num_rows);
+    realloc_column(edges->parent, num_rows);
+    realloc_column(edges->child, num_rows);
+    realloc_column(edges->metadata_offset, num_rows + 1);
+    edges->max_rows = num_rows;
+}
+
+void
+reserve_node_table_rows(tsk_node_table_t* nodes, tsk_size_t num_rows)
+// Same as reserve_edge_table_rows, for the node table.
+{
+    if (nodes->metadata_length != 0)
+        {
+            throw std::invalid_argument("node metadata are not supported");
+        }
+    if (num_rows <= nodes->max_rows)
+        {
+            return;
+        }
+    realloc_column(nodes->flags, num_rows);
+    realloc_column(nodes->time, num_rows);
+    realloc_column(nodes->population, num_rows);
+    realloc_column(nodes->individual, num_rows);
+    realloc_column(nodes->metadata_offset, num_rows + 1);
+    nodes->max_rows = num_rows;
+}
+
+tsk_size_t
+grown_capacity(tsk_size_t capacity, tsk_size_t num_rows)
+// The capacity to reserve for num_rows rows.  It at least
+// doubles when it has to grow, so appending to a table is
+// amortized O(1).  tskit grows tables by a fixed number of
+// rows instead.
+{
+    if (num_rows <= capacity)
+        {
+            return capacity;
+        }
+    return std::max(num_rows, 2 * capacity);
+}
+
+void
+handle_tskit_return_code(int code)
+{
+    if (code != 0)
+        {
+            std::ostringstream o;
+            o << tsk_strerror(code);
+            throw std::runtime_error(o.str());
+        }
+}
+
+std::size_t
+node_table_bytes(const tsk_node_table_t& nodes)
+// Memory allocated for the columns, which is
+// set by max_rows rather than num_rows.
+{
+    return nodes.max_rows
+               * (sizeof(tsk_flags_t) + sizeof(double) + 2 * sizeof(tsk_id_t))
+           + (nodes.max_rows + 1) * sizeof(tsk_size_t) + nodes.max_metadata_length;
+}
+
+std::size_t
+edge_table_bytes(const tsk_edge_table_t& edges)
+{
+    return edges.max_rows * (2 * sizeof(double) + 2 * sizeof(tsk_id_t))
+           + (edges.max_rows + 1) * sizeof(tsk_size_t) + edges.max_metadata_length;
+}
@@ -8,3 +8,13 @@ using table_collection_ptr
     = std::unique_ptr<tsk_table_collection_t, std::function<void(tsk_table_collection_t*)>>;
 
 table_collection_ptr make_table_collection_ptr(double sequence_length);
+
+void reserve_edge_table_rows(tsk_edge_table_t* edges, tsk_size_t num_rows);
+void reserve_node_table_rows(tsk_node_table_t* nodes, tsk_size_t num_rows);
+tsk_size_t grown_capacity(tsk_size_t capacity, tsk_size_t num_rows);
+
+// Throws std::runtime_error with tskit's message if code is an error.
+void handle_tskit_return_code(int code);
+
+std::size_t node_table_bytes(const tsk_node_table_t& nodes);
+std::size_t edge_table_bytes(const tsk_edge_table_t& edges);
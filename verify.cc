@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <tbb/parallel_sort.h>
+#include "verify.hpp"
+
+namespace
+{
+    struct Edge
+    {
+        double left, right;
+        tsk_id_t parent, child;
+        // Row in the edge table
+        std::size_t row;
+    };
+
+    bool
+    edge_less(const Edge& a, const Edge& b)
+    {
+        return std::tie(a.child, a.left, a.right, a.parent)
+               < std::tie(b.child, b.left, b.right, b.parent);
+    }
+
+    std::vector<Edge>
+    get_edges(const tsk_edge_table_t& edges)
+    {
+        std::vector<Edge> rv(edges.num_rows);
+        for (tsk_size_t j = 0; j < edges.num_rows; ++j)
+            {
+                rv[j] = {edges.left[j], edges.right[j], edges.parent[j], edges.child[j], j};
+            }
+        return rv;
+    }
+
+    [[noreturn]] void
+    report_difference(double left, double right, const std::string& what)
+    {
+        std::ostringstream o;
+        o << "tree sequences differ on [" << left << ", " << right << "): " << what;
+        throw std::runtime_error(o.str());
+    }
+}
+
+command_line_options
+sort_and_simplify_options(const command_line_options& options)
+// Births are the same with or without buffering, including the
+// rounding of breakpoints for --compact_buffer, so we keep that.
+{
+    auto rv = options;
+    rv.buffer_new_edges = false;
+    rv.stitch_in_place = false;
+    rv.native_simplify = false;
+    rv.async_simplify = false;
+    rv.prune_interval = 0;
+    rv.verify = false;
+    rv.stats_json.clear();
+    rv.checkpoint.clear();
+    return rv;
+}
+
+void
+verify_same_trees(const table_collection_ptr& first, const table_collection_ptr& second)
+// Buffering changes the order in which nodes and edges are output,
+// so the tables are not identical even when the trees are.  Instead,
+// we match the nodes of the two tables:  samples have the same IDs,
+// and the parent of a matched child at a position is matched with
+// the parent of the matching child at that position, if they have
+// the same time.  Going through the edges from the youngest child up
+// matches every node when the trees are the same, and then they are
+// the same if the relabelled edge tables are.  Nodes that do not
+// match are left out, so that their edges differ.  Throws
+// std::runtime_error describing the difference that is leftmost
+// on the genome.
+{
+    const auto& nodes = first->nodes;
+    const auto& other_nodes = second->nodes;
+    std::vector<tsk_id_t> node_map(nodes.num_rows, TSK_NULL),
+        matched(other_nodes.num_rows, TSK_NULL);
+    for (tsk_size_t u = 0; u < nodes.num_rows; ++u)
+        {
+            if (nodes.flags[u] & TSK_NODE_IS_SAMPLE)
+                {
+                    if (u >= other_nodes.num_rows
+                        || (other_nodes.flags[u] & TSK_NODE_IS_SAMPLE) == 0
+                        || other_nodes.time[u] != nodes.time[u])
+                        {
+                            std::ostringstream o;
+                            o << "sample " << u << " differs between tree sequences";
+                            throw std::runtime_error(o.str());
+                        }
+                    node_map[u] = matched[u] = static_cast<tsk_id_t>(u);
+                }
+        }
+
+    // The edges of the second tables, sorted so that those
+    // of each child are together and ordered by left.
+    auto other_edges = get_edges(second->edges);
+    tbb::parallel_sort(other_edges.begin(), other_edges.end(), edge_less);
+    std::vector<std::size_t> child_offsets(other_nodes.num_rows + 1, 0);
+    for (const auto& e : other_edges)
+        {
+            ++child_offsets[e.child + 1];
+        }
+    std::partial_sum(child_offsets.begin(), child_offsets.end(), child_offsets.begin());
+
+    auto edges = get_edges(first->edges);
+    tbb::parallel_sort(edges.begin(), edges.end(), [&nodes](const Edge& a, const Edge& b) {
+        return std::tie(nodes.time[a.child], a.child, a.left)
+               < std::tie(nodes.time[b.child], b.child, b.left);
+    });
+    for (const auto& e : edges)
+        {
+            auto c = node_map[e.child];
+            if (c == TSK_NULL)
+                {
+                    continue;
+                }
+            auto b = other_edges.begin() + child_offsets[c];
+            auto f = other_edges.begin() + child_offsets[c + 1];
+            auto i = std::upper_bound(b, f, e.left, [](double x, const Edge& other) {
+                return x < other.left;
+            });
+            if (i == b || std::prev(i)->right <= e.left)
+                {
+                    continue;
+                }
+            auto p = std::prev(i)->parent;
+            if (node_map[e.parent] == TSK_NULL && matched[p] == TSK_NULL
+                && nodes.time[e.parent] == other_nodes.time[p])
+                {
+                    node_map[e.parent] = p;
+                    matched[p] = e.parent;
+                }
+        }
+
+    for (auto& e : edges)
+        {
+            e.parent = node_map[e.parent];
+            e.child = node_map[e.child];
+        }
+    tbb::parallel_sort(edges.begin(), edges.end(), edge_less);
+    // Edges in only one of the tables, with the smallest left
+    const Edge* first_only = nullptr;
+    const Edge* second_only = nullptr;
+    auto note = [](const Edge* e, const Edge*& earliest) {
+        if (earliest == nullptr || e->left < earliest->left)
+            {
+                earliest = e;
+            }
+    };
+    std::size_t i = 0, j = 0;
+    while (i < edges.size() || j < other_edges.size())
+        {
+            if (j == other_edges.size()
+                || (i < edges.size() && edge_less(edges[i], other_edges[j])))
+                {
+                    note(&edges[i++], first_only);
+                }
+            else if (i == edges.size() || edge_less(other_edges[j], edges[i]))
+                {
+                    note(&other_edges[j++], second_only);
+                }
+            else
+                {
+                    ++i;
+                    ++j;
+                }
+        }
+    if (first_only != nullptr || second_only != nullptr)
+        {
+            const bool in_first = second_only == nullptr
+                                  || (first_only != nullptr
+                                      && first_only->left <= second_only->left);
+            const Edge* e = in_first ? first_only : second_only;
+            const auto& table = in_first ? first->edges : second->edges;
+            std::ostringstream o;
+            o << "edge " << e->row << " of the " << (in_first ? "first" : "second")
+              << ", from node " << table.parent[e->row] << " to node "
+              << table.child[e->row] << ", is not in the "
+              << (in_first ? "second" : "first");
+            report_difference(e->left, e->right, o.str());
+        }
+
+    if (nodes.num_rows != other_nodes.num_rows)
+        {
+            std::ostringstream o;
+            o << "tree sequences differ: " << nodes.num_rows << " and "
+              << other_nodes.num_rows << " nodes";
+            throw std::runtime_error(o.str());
+        }
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "options.hpp"
+#include "tskit_tools.hpp"
+
+// The options for the run that --verify compares against:  the
+// same simulation, with the edges sorted and simplified.
+command_line_options sort_and_simplify_options(const command_line_options& options);
+
+void verify_same_trees(const table_collection_ptr& first,
+                       const table_collection_ptr& second);
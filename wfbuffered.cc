@@ -3,6 +3,9 @@
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <memory>
 #include <tskit.h>
 
 #include <boost/program_options.hpp>
@@ -10,14 +13,44 @@
 #include "rng.hpp"
 #include "tskit_tools.hpp"
 #include "simulate.hpp"
+#include "stats.hpp"
 #include "options.hpp"
 #include "cli.hpp"
+#include "sweep.hpp"
+#include "verify.hpp"
 
 namespace po = boost::program_options;
 
+static int
+sweep_main(int argc, char **argv)
+// wfbuffered sweep [options]
+{
+    sweep_options options;
+
+    auto cli = generate_sweep_options(options);
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, cli), vm);
+    po::notify(vm);
+    validate_sweep(options);
+
+    if (vm.count("help"))
+        {
+            std::cout << cli << '\n';
+            std::exit(1);
+        }
+    run_sweep(options);
+    return 0;
+}
+
 int
 main(int argc, char **argv)
 {
+    if (argc > 1 && std::strcmp(argv[1], "sweep") == 0)
+        {
+            // The sweep options start after "sweep"
+            return sweep_main(argc - 1, argv + 1);
+        }
+
     command_line_options options;
 
     auto cli = generate_main_options(options);
@@ -33,9 +66,35 @@ main(int argc, char **argv)
         }
     auto rng = make_rng(options.seed);
     auto tables = make_table_collection_ptr(1.);
-    simulate(rng, options.N, options.psurvival, options.nsteps,
-             options.simplification_interval, options.rho, options.buffer_new_edges,
-             options.cppsort, options.parallel_sort, tables);
+    std::unique_ptr<SimulationStats> stats(nullptr);
+    if (options.stats_json.empty() == false)
+        {
+            stats.reset(new SimulationStats());
+        }
+    auto start = std::chrono::steady_clock::now();
+    if (options.resume.empty())
+        {
+            simulate(rng, options, stats.get(), tables);
+        }
+    else
+        {
+            auto state = read_checkpoint(options.resume, rng, tables);
+            resume_simulation(rng, options, state, stats.get(), tables);
+        }
+    if (stats != nullptr)
+        {
+            std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+            stats->total_seconds = dt.count();
+            write_stats_json(*stats, options, options.stats_json);
+        }
     auto ret = tsk_table_collection_build_index(tables.get(), 0);
     ret = tsk_table_collection_dump(tables.get(), options.treefile.c_str(), 0);
+    if (options.verify)
+        {
+            auto reference_rng = make_rng(options.seed);
+            auto reference = make_table_collection_ptr(1.);
+            simulate(reference_rng, sort_and_simplify_options(options), nullptr,
+                     reference);
+            verify_same_trees(reference, tables);
+        }
 }
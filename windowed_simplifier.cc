@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include "windowed_simplifier.hpp"
+
+namespace
+{
+    const std::size_t NO_RANK = std::numeric_limits<std::size_t>::max();
+
+    template <typename T>
+    std::size_t
+    capacity_bytes(const std::vector<T>& v)
+    {
+        return v.capacity() * sizeof(T);
+    }
+
+    void
+    clip_edges(const tsk_edge_table_t& input, double left, double right,
+               tsk_edge_table_t* edges)
+    // Replace edges with the parts of the input edges in [left, right),
+    // in the same order, so that they stay sorted.
+    {
+        tsk_size_t n = 0;
+        for (tsk_size_t j = 0; j < input.num_rows; ++j)
+            {
+                n += input.left[j] < right && input.right[j] > left;
+            }
+        handle_tskit_return_code(tsk_edge_table_clear(edges));
+        reserve_edge_table_rows(edges, n);
+        tsk_size_t i = 0;
+        for (tsk_size_t j = 0; j < input.num_rows; ++j)
+            {
+                if (input.left[j] < right && input.right[j] > left)
+                    {
+                        edges->left[i] = std::max(input.left[j], left);
+                        edges->right[i] = std::min(input.right[j], right);
+                        edges->parent[i] = input.parent[j];
+                        edges->child[i] = input.child[j];
+                        edges->metadata_offset[i + 1] = 0;
+                        ++i;
+                    }
+            }
+        edges->num_rows = n;
+    }
+
+    bool
+    edge_order(const WindowedSimplifier::Edge& a, const WindowedSimplifier::Edge& b)
+    // The order of the edge table output by simplifying the whole
+    // genome:  the edges of each parent are output together, in the
+    // order that parents are processed, sorted by child and then left.
+    {
+        if (a.rank != b.rank)
+            {
+                return a.rank < b.rank;
+            }
+        if (a.child != b.child)
+            {
+                return a.child < b.child;
+            }
+        return a.left < b.left;
+    }
+}
+
+WindowedSimplifier::WindowedSimplifier(std::size_t num_windows_, double sequence_length,
+                                       tbb::task_arena& arena_)
+    : num_windows{num_windows_}, arena(arena_), windows{},
+      window_node_maps(num_windows_), merged_nodes(num_windows_), input_rank{},
+      output_rank{}, edge_offsets{}, edges{}, flags{}, time{}, population{},
+      individual{}, left{}, right{}, parent{}, child{}
+{
+    if (num_windows == 0)
+        {
+            throw std::invalid_argument("num_windows must be > 0");
+        }
+    for (std::size_t k = 0; k < num_windows; ++k)
+        {
+            windows.emplace_back(make_table_collection_ptr(sequence_length));
+        }
+}
+
+std::size_t
+windowed_simplifier_bytes(const WindowedSimplifier& s)
+{
+    std::size_t bytes = capacity_bytes(s.input_rank) + capacity_bytes(s.output_rank)
+                        + capacity_bytes(s.edge_offsets) + capacity_bytes(s.edges)
+                        + capacity_bytes(s.flags) + capacity_bytes(s.time)
+                        + capacity_bytes(s.population) + capacity_bytes(s.individual)
+                        + capacity_bytes(s.left) + capacity_bytes(s.right)
+                        + capacity_bytes(s.parent) + capacity_bytes(s.child);
+    for (std::size_t k = 0; k < s.num_windows; ++k)
+        {
+            bytes += node_table_bytes(s.windows[k]->nodes)
+                     + edge_table_bytes(s.windows[k]->edges)
+                     + capacity_bytes(s.window_node_maps[k])
+                     + capacity_bytes(s.merged_nodes[k]);
+        }
+    return bytes;
+}
+
+void
+simplify_in_windows(const std::vector<tsk_id_t>& samples, WindowedSimplifier& s,
+                    std::vector<tsk_id_t>& node_map, table_collection_ptr& tables)
+// The edge table must be sorted as required by tsk_table_collection_simplify.
+{
+    const auto& nodes = tables->nodes;
+    const auto& input_edges = tables->edges;
+    const std::size_t num_nodes = nodes.num_rows;
+    const double L = tables->sequence_length;
+    const std::size_t K = s.num_windows;
+
+    s.arena.execute([&]() {
+        tbb::parallel_for(std::size_t{0}, K, [&](std::size_t k) {
+            auto& window = s.windows[k];
+            window->sequence_length = L;
+            handle_tskit_return_code(tsk_node_table_set_columns(
+                &window->nodes, nodes.num_rows, nodes.flags, nodes.time,
+                nodes.population, nodes.individual, nullptr, nullptr));
+            const double window_left = L * static_cast<double>(k) / K;
+            const double window_right
+                = k + 1 == K ? L : L * static_cast<double>(k + 1) / K;
+            clip_edges(input_edges, window_left, window_right, &window->edges);
+            s.window_node_maps[k].resize(num_nodes);
+            handle_tskit_return_code(tsk_table_collection_simplify(
+                window.get(), samples.data(), samples.size(), 0,
+                s.window_node_maps[k].data()));
+        });
+    });
+
+    // Node retention.  Simplification outputs the samples first,
+    // and then each node kept in the order that it is processed
+    // as a parent, which is the order of the input edge table.
+    s.input_rank.assign(num_nodes, NO_RANK);
+    s.output_rank.clear();
+    s.flags.clear();
+    s.time.clear();
+    s.population.clear();
+    s.individual.clear();
+    node_map.assign(num_nodes, TSK_NULL);
+    auto record_node = [&](tsk_id_t u) {
+        for (std::size_t k = 0; k < K; ++k)
+            {
+                auto w = s.window_node_maps[k][u];
+                if (w != TSK_NULL)
+                    {
+                        const auto& window_nodes = s.windows[k]->nodes;
+                        node_map[u] = static_cast<tsk_id_t>(s.flags.size());
+                        s.flags.push_back(window_nodes.flags[w]);
+                        s.time.push_back(window_nodes.time[w]);
+                        s.population.push_back(window_nodes.population[w]);
+                        s.individual.push_back(window_nodes.individual[w]);
+                        s.output_rank.push_back(s.input_rank[u]);
+                        return;
+                    }
+            }
+    };
+    std::size_t rank = 0;
+    for (tsk_size_t j = 0; j < input_edges.num_rows; ++j)
+        {
+            auto p = input_edges.parent[j];
+            if (s.input_rank[p] == NO_RANK)
+                {
+                    s.input_rank[p] = rank++;
+                }
+        }
+    for (auto u : samples)
+        {
+            record_node(u);
+            if (node_map[u] == TSK_NULL)
+                {
+                    throw std::runtime_error("sample not kept by simplification");
+                }
+        }
+    for (tsk_size_t j = 0; j < input_edges.num_rows; ++j)
+        {
+            auto p = input_edges.parent[j];
+            if (node_map[p] == TSK_NULL && (j == 0 || input_edges.parent[j - 1] != p))
+                {
+                    record_node(p);
+                }
+        }
+
+    // Gather the output edges of all windows, relabelled with merged
+    // output nodes.  Within a window, output node IDs are in the same
+    // order as merged output node IDs, so sorting the edges in
+    // edge_order puts the pieces of an edge cut by window boundaries
+    // next to each other.
+    s.edge_offsets.assign(K + 1, 0);
+    for (std::size_t k = 0; k < K; ++k)
+        {
+            s.edge_offsets[k + 1] = s.edge_offsets[k] + s.windows[k]->edges.num_rows;
+        }
+    s.edges.resize(s.edge_offsets[K]);
+    s.arena.execute([&]() {
+        tbb::parallel_for(std::size_t{0}, K, [&](std::size_t k) {
+            const auto& window_map = s.window_node_maps[k];
+            auto& merged = s.merged_nodes[k];
+            merged.resize(s.windows[k]->nodes.num_rows);
+            for (std::size_t u = 0; u < num_nodes; ++u)
+                {
+                    if (window_map[u] != TSK_NULL)
+                        {
+                            merged[window_map[u]] = node_map[u];
+                        }
+                }
+            const auto& window_edges = s.windows[k]->edges;
+            auto out = s.edges.begin() + s.edge_offsets[k];
+            for (tsk_size_t j = 0; j < window_edges.num_rows; ++j, ++out)
+                {
+                    auto p = merged[window_edges.parent[j]];
+                    *out = {s.output_rank[p], p, merged[window_edges.child[j]],
+                            window_edges.left[j], window_edges.right[j]};
+                }
+        });
+        tbb::parallel_sort(s.edges.begin(), s.edges.end(), edge_order);
+    });
+
+    s.left.clear();
+    s.right.clear();
+    s.parent.clear();
+    s.child.clear();
+    for (const auto& e : s.edges)
+        {
+            if (s.left.empty() == false && s.parent.back() == e.parent
+                && s.child.back() == e.child && s.right.back() == e.left)
+                {
+                    s.right.back() = e.right;
+                }
+            else
+                {
+                    s.left.push_back(e.left);
+                    s.right.push_back(e.right);
+                    s.parent.push_back(e.parent);
+                    s.child.push_back(e.child);
+                }
+        }
+
+    handle_tskit_return_code(tsk_node_table_set_columns(
+        &tables->nodes, s.flags.size(), s.flags.data(), s.time.data(),
+        s.population.data(), s.individual.data(), nullptr, nullptr));
+    handle_tskit_return_code(tsk_edge_table_set_columns(
+        &tables->edges, s.left.size(), s.left.data(), s.right.data(), s.parent.data(),
+        s.child.data(), nullptr, nullptr));
+}
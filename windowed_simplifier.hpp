@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <tbb/task_arena.h>
+#include <tskit.h>
+#include "tskit_tools.hpp"
+
+struct WindowedSimplifier
+// Simplification of the genome in windows, for --simplify_windows.
+//
+// The ancestry of a position only depends on the edges that
+// overlap it, so we clip the edges to each of num_windows windows
+// of equal length and simplify each window with tskit, in parallel.
+// The outputs are then merged:  a node is kept if any window keeps
+// it, output nodes are numbered in the order that simplifying the
+// whole genome would number them, and edges that were cut at window
+// boundaries are joined back together.  So the node table, edge
+// table, and node map are the same as from tsk_table_collection_simplify.
+// The windows are simplified on arena, which is shared with the
+// other parallel phases of the simulation.
+//
+// The members other than num_windows and arena are working storage
+// that we keep to re-use their memory between simplifications.
+{
+    struct Edge
+    {
+        // Order of the input parent in the input edge table
+        std::size_t rank;
+        tsk_id_t parent, child;
+        double left, right;
+    };
+
+    std::size_t num_windows;
+    tbb::task_arena& arena;
+    std::vector<table_collection_ptr> windows;
+    // The node map of each window, and the map from
+    // the output nodes of each window to merged output nodes
+    std::vector<std::vector<tsk_id_t>> window_node_maps, merged_nodes;
+    // Order of each input node as a parent in the input edge
+    // table, and the same for each merged output node
+    std::vector<std::size_t> input_rank, output_rank;
+    std::vector<std::size_t> edge_offsets;
+    std::vector<Edge> edges;
+
+    // Output tables
+    std::vector<tsk_flags_t> flags;
+    std::vector<double> time;
+    std::vector<tsk_id_t> population, individual;
+    std::vector<double> left, right;
+    std::vector<tsk_id_t> parent, child;
+
+    WindowedSimplifier(std::size_t num_windows_, double sequence_length,
+                       tbb::task_arena& arena_);
+};
+
+std::size_t windowed_simplifier_bytes(const WindowedSimplifier& simplifier);
+
+void simplify_in_windows(const std::vector<tsk_id_t>& samples,
+                         WindowedSimplifier& simplifier, std::vector<tsk_id_t>& node_map,
+                         table_collection_ptr& tables);